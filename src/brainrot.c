@@ -1,11 +1,13 @@
 #include <assert.h> // assert
-#include <stdlib.h> // malloc, abort
+#include <stdio.h>  // printf
+#include <stdlib.h> // malloc, abort, qsort, strtol, strtod, strtoull
 #include <stddef.h> // NULL
 #include <time.h>   // time
 #include <math.h>   // sinf, cosf, M_PI, roundf, sqrtf, fabsf, floorf
-#include <string.h> // memset
+#include <string.h> // memset, memmove, strcmp
 
 #include "gui.h"
+#include "jobs.h"
 
 // Redefinition of typedefs is a C11 feature.
 // This is the official™ guard, which is used across different headers to protect u8 and friends.
@@ -98,6 +100,17 @@ void *arena_alloc(Arena *arena, isize size) {
     return ptr;
 }
 
+// Takes the memory from the heap. Arenas created this way are never freed.
+bool arena_create(isize capacity, Arena *arena) {
+    u8 *memory = malloc(capacity);
+    if (memory == NULL) {
+        return false;
+    }
+
+    *arena = (Arena){memory, memory + capacity};
+    return true;
+}
+
 static inline f64 f64_random(PCG32 *rng) {
     return (f64)pcg32_random(rng) * 0x1P-32;
 }
@@ -133,6 +146,14 @@ static inline f32 f32_min(f32 left, f32 right) {
     return left < right ? left : right;
 }
 
+static inline f64 f64_max(f64 left, f64 right) {
+    return left > right ? left : right;
+}
+
+static inline f64 f64_min(f64 left, f64 right) {
+    return left < right ? left : right;
+}
+
 typedef struct {
     f32 x;
     f32 y;
@@ -340,115 +361,425 @@ static inline Bitmap sub_bitmap(Bitmap const *bitmap, f32box2 box) {
     };
 }
 
-void bitmap_clear(Bitmap *bitmap, u32 color) {
-    for (isize y = 0; y < bitmap->height; y += 1) {
-        for (isize x = 0; x < bitmap->width; x += 1) {
-            bitmap->pixels[y * bitmap->stride + x] = color;
+// Primitives don't write into a bitmap directly. Instead they emit horizontal spans of pixels,
+// which are collected per row and then resolved row by row in a single pass, so that each row of
+// the bitmap is touched once while it is hot in cache.
+
+typedef enum {
+    // Overwrite the destination pixels.
+    SPAN_COPY,
+    // Blend the color over the destination pixels using the alpha of the color.
+    SPAN_BLEND,
+    // Overwrite the destination pixels with the pixels of another bitmap, possibly upscaled.
+    SPAN_PIXELS,
+} SpanMode;
+
+typedef struct Span Span;
+
+struct Span {
+    Span *next;
+
+    // Both ends are inclusive.
+    i32 from_x;
+    i32 to_x;
+
+    u32 color;
+    SpanMode mode;
+
+    // Only for SPAN_PIXELS: pixels[i] goes into the columns from pixels_x + i * pixels_scale up to
+    // pixels_x + (i + 1) * pixels_scale - 1.
+    u32 const *pixels;
+    i32 pixels_x;
+    i32 pixels_scale;
+};
+
+// Spans of each row are kept in the order they were emitted in, which is the order in which they
+// get resolved.
+typedef struct {
+    Arena *arena;
+
+    Span **row_first;
+    Span **row_last;
+
+    int width, height;
+} SpanBuffer;
+
+void span_buffer_create(Arena *arena, int width, int height, SpanBuffer *buffer) {
+    buffer->arena = arena;
+
+    buffer->row_first = arena_alloc(arena, height * sizeof(Span *));
+    buffer->row_last = arena_alloc(arena, height * sizeof(Span *));
+    if (height > 0) {
+        memset(buffer->row_first, 0, height * sizeof(Span *));
+        memset(buffer->row_last, 0, height * sizeof(Span *));
+    }
+
+    buffer->width = width;
+    buffer->height = height;
+}
+
+typedef struct {
+    i32 from_x;
+    i32 to_x;
+} SpanInterval;
+
+// Adds an interval to a sorted list of disjoint intervals, merging it with the ones it overlaps or
+// touches.
+static void span_intervals_add(SpanInterval *intervals, isize *interval_count, SpanInterval new) {
+    isize first = 0;
+    while (first < *interval_count && intervals[first].to_x < new.from_x - 1) {
+        first += 1;
+    }
+
+    isize last = first;
+    while (last < *interval_count && intervals[last].from_x <= new.to_x + 1) {
+        new.from_x = intervals[last].from_x < new.from_x ? intervals[last].from_x : new.from_x;
+        new.to_x = intervals[last].to_x > new.to_x ? intervals[last].to_x : new.to_x;
+        last += 1;
+    }
+
+    // Replace intervals[first..last) with the merged one.
+    isize removed_count = last - first;
+    if (removed_count != 1) {
+        memmove(
+            &intervals[first + 1],
+            &intervals[last],
+            (*interval_count - last) * sizeof(SpanInterval)
+        );
+        *interval_count += 1 - removed_count;
+    }
+    intervals[first] = new;
+}
+
+// Writes count pixels starting from the column offset of the source row blown up scale times.
+static void pixels_expand(u32 *dest, u32 const *source, isize offset, isize count, isize scale) {
+    source += offset / scale;
+
+    // The first source pixel might be cut off on the left.
+    isize i = isize_min(scale - offset % scale, count);
+    for (isize j = 0; j < i; j += 1) {
+        dest[j] = *source;
+    }
+    source += 1;
+
+    // Pixel doubling is the common case, which gets a loop of its own.
+    if (scale == 2) {
+        for (; i + 2 <= count; i += 2) {
+            u32 pixel = *source++;
+            dest[i] = pixel;
+            dest[i + 1] = pixel;
+        }
+    } else {
+        for (; i + scale <= count; i += scale) {
+            u32 pixel = *source++;
+            for (isize j = 0; j < scale; j += 1) {
+                dest[i + j] = pixel;
+            }
         }
     }
+
+    // The last source pixel might be cut off on the right.
+    for (; i < count; i += 1) {
+        dest[i] = *source;
+    }
 }
 
-static inline void bitmap_set_pixel(
-    Bitmap *bitmap,
-    isize x, isize y,
-    u32 color
-) {
-    if (x < 0 || x >= bitmap->width) {
-        return;
+// Before touching a row, its spans are walked from the topmost to the bottommost one, and each span
+// is clipped against the union of the opaque (SPAN_COPY and SPAN_PIXELS) spans above it. Only the
+// visible pieces get written, so the background and anything else hidden under opaque spans is
+// never written at all, while the pixels which do get written end up exactly the same.
+void span_buffer_resolve(SpanBuffer const *buffer, Bitmap *bitmap) {
+    assert(buffer->width == bitmap->width && buffer->height == bitmap->height);
+
+    // Everything emitted is already in the arena, so the memory past it can be used as scratch.
+    Arena scratch = *buffer->arena;
+    u8 *scratch_begin = scratch.begin;
+
+    for (isize y = 0; y < buffer->height; y += 1) {
+        scratch.begin = scratch_begin;
+
+        isize span_count = 0;
+        for (Span *span = buffer->row_first[y]; span != NULL; span = span->next) {
+            span_count += 1;
+        }
+        if (span_count == 0) {
+            continue;
+        }
+
+        Span **spans = arena_alloc(&scratch, span_count * sizeof(Span *));
+        {
+            isize i = 0;
+            for (Span *span = buffer->row_first[y]; span != NULL; span = span->next) {
+                spans[i++] = span;
+            }
+        }
+
+        SpanInterval *covered = arena_alloc(&scratch, span_count * sizeof(SpanInterval));
+        isize covered_count = 0;
+
+        // Visible pieces are pushed from the topmost span down, so popping them gives the original
+        // bottom-to-top order back.
+        Span *visible = NULL;
+
+        for (isize i = span_count - 1; i >= 0; i -= 1) {
+            Span const *span = spans[i];
+
+            isize from_x = span->from_x;
+            for (isize j = 0; j < covered_count && from_x <= span->to_x; j += 1) {
+                if (covered[j].to_x < from_x) {
+                    continue;
+                }
+
+                if (covered[j].from_x > from_x) {
+                    Span *piece = arena_alloc(&scratch, sizeof(Span));
+                    *piece = *span;
+                    piece->from_x = from_x;
+                    piece->to_x = isize_min(covered[j].from_x - 1, span->to_x);
+                    piece->next = visible;
+                    visible = piece;
+                }
+                from_x = covered[j].to_x + 1;
+            }
+            if (from_x <= span->to_x) {
+                Span *piece = arena_alloc(&scratch, sizeof(Span));
+                *piece = *span;
+                piece->from_x = from_x;
+                piece->next = visible;
+                visible = piece;
+            }
+
+            if (span->mode != SPAN_BLEND) {
+                span_intervals_add(
+                    covered, &covered_count, (SpanInterval){span->from_x, span->to_x}
+                );
+
+                // Nothing below a fully covered row can be seen.
+                if (
+                    covered_count == 1 &&
+                    covered[0].from_x == 0 && covered[0].to_x == buffer->width - 1
+                ) {
+                    break;
+                }
+            }
+        }
+
+        u32 *row = &bitmap->pixels[y * bitmap->stride];
+
+        for (Span *span = visible; span != NULL; span = span->next) {
+            u32 *row_iter = &row[span->from_x];
+            isize pixel_count = span->to_x - span->from_x + 1;
+
+            switch (span->mode) {
+            case SPAN_COPY: {
+                for (isize i = 0; i < pixel_count; i += 1) {
+                    row_iter[i] = span->color;
+                }
+            } break;
+
+            case SPAN_BLEND: {
+                for (isize i = 0; i < pixel_count; i += 1) {
+                    row_iter[i] = color_blend(row_iter[i], span->color);
+                }
+            } break;
+
+            case SPAN_PIXELS: {
+                isize offset = span->from_x - span->pixels_x;
+                if (span->pixels_scale == 1) {
+                    memcpy(row_iter, &span->pixels[offset], pixel_count * sizeof(u32));
+                } else {
+                    pixels_expand(row_iter, span->pixels, offset, pixel_count, span->pixels_scale);
+                }
+            } break;
+            }
+        }
     }
-    if (y < 0 || y >= bitmap->height) {
-        return;
+}
+
+// A rectangular area which primitives get drawn into. Coordinates passed to the primitives are
+// relative to the top-left corner of the canvas, and everything outside of the canvas gets clipped
+// away. The canvas may lie partially outside of the span buffer (when the buffer only covers a
+// single tile of the frame), in which case spans get clipped against the buffer as well.
+typedef struct {
+    SpanBuffer *spans;
+    int x, y;
+    int width, height;
+} Canvas;
+
+// Narrows the range of rows down to the ones which lie both within the canvas and within the span
+// buffer.
+static inline void canvas_clip_rows(Canvas const *canvas, isize *from_y, isize *to_y) {
+    *from_y = isize_max(*from_y, isize_max(0, -canvas->y));
+    *to_y = isize_min(*to_y, isize_min(canvas->height, canvas->spans->height - canvas->y) - 1);
+}
+
+// Returns false if nothing is left of the span after clipping it against the canvas and the span
+// buffer.
+static inline bool canvas_clip_span(Canvas const *canvas, isize *from_x, isize *to_x, isize y) {
+    assert(*from_x <= *to_x);
+
+    isize min_x = isize_max(0, -canvas->x);
+    isize max_x = isize_min(canvas->width, canvas->spans->width - canvas->x) - 1;
+    if (*to_x < min_x || *from_x > max_x) {
+        return false;
+    }
+
+    isize min_y = isize_max(0, -canvas->y);
+    isize max_y = isize_min(canvas->height, canvas->spans->height - canvas->y) - 1;
+    if (y < min_y || y > max_y) {
+        return false;
     }
 
-    u32 *background = &bitmap->pixels[y * bitmap->stride + x];
-    *background = color_blend(*background, color);
+    *from_x = isize_max(*from_x, min_x);
+    *to_x = isize_min(*to_x, max_x);
+    return true;
 }
 
-static inline void bitmap_set_row_pixels(
-    Bitmap *bitmap,
+// Appends a span to its row. The span is expected to be clipped already.
+static inline Span *canvas_push_span(Canvas *canvas, isize from_x, isize to_x, isize y) {
+    Span *span = arena_alloc(canvas->spans->arena, sizeof(Span));
+    span->next = NULL;
+    span->from_x = canvas->x + from_x;
+    span->to_x = canvas->x + to_x;
+
+    isize row = canvas->y + y;
+    if (canvas->spans->row_last[row] == NULL) {
+        canvas->spans->row_first[row] = span;
+    } else {
+        canvas->spans->row_last[row]->next = span;
+    }
+    canvas->spans->row_last[row] = span;
+
+    return span;
+}
+
+static inline void canvas_emit_span(
+    Canvas *canvas,
     isize from_x, isize to_x,
     isize y,
-    u32 color
+    u32 color, SpanMode mode
 ) {
-    assert(from_x <= to_x);
-
-    if (to_x < 0 || from_x >= bitmap->width) {
+    if (!canvas_clip_span(canvas, &from_x, &to_x, y)) {
         return;
     }
-    if (y < 0 || y >= bitmap->height) {
-        return;
+
+    // Fully transparent spans change nothing, and fully opaque ones can be copied, which also
+    // lets them hide whatever is below them.
+    if (mode == SPAN_BLEND) {
+        u32 alpha = color >> 24;
+        if (alpha == 0x00) {
+            return;
+        }
+        if (alpha == 0xff) {
+            mode = SPAN_COPY;
+        }
     }
 
-    from_x = isize_max(from_x, 0);
-    to_x = isize_min(to_x, bitmap->width - 1);
+    Span *span = canvas_push_span(canvas, from_x, to_x, y);
+    span->color = color;
+    span->mode = mode;
+}
 
-    u32 *row_iter = &bitmap->pixels[y * bitmap->stride + from_x];
-    for (isize i = 0; i < to_x - from_x + 1; i += 1) {
-        *row_iter = color_blend(*row_iter, color);
-        row_iter += 1;
+// The pixels are copied from pixels[0] onwards, starting at from_x, each one repeated scale times.
+static inline void canvas_emit_pixels(
+    Canvas *canvas,
+    isize from_x, isize to_x,
+    isize y,
+    u32 const *pixels, int scale
+) {
+    isize pixels_x = canvas->x + from_x;
+    if (!canvas_clip_span(canvas, &from_x, &to_x, y)) {
+        return;
     }
+
+    Span *span = canvas_push_span(canvas, from_x, to_x, y);
+    span->mode = SPAN_PIXELS;
+    span->pixels = pixels;
+    span->pixels_x = pixels_x;
+    span->pixels_scale = scale;
 }
 
-static inline void bitmap_set_column_pixels(
-    Bitmap *bitmap,
+static inline void canvas_set_pixel(
+    Canvas *canvas,
+    isize x, isize y,
+    u32 color
+) {
+    canvas_emit_span(canvas, x, x, y, color, SPAN_BLEND);
+}
+
+static inline void canvas_set_row_pixels(
+    Canvas *canvas,
+    isize from_x, isize to_x,
+    isize y,
+    u32 color
+) {
+    canvas_emit_span(canvas, from_x, to_x, y, color, SPAN_BLEND);
+}
+
+static inline void canvas_set_column_pixels(
+    Canvas *canvas,
     isize x,
     isize from_y, isize to_y,
     u32 color
 ) {
     assert(from_y <= to_y);
 
-    if (to_y < 0 || from_y >= bitmap->height) {
-        return;
-    }
-    if (x < 0 || x >= bitmap->width) {
+    if (x < 0 || x >= canvas->width) {
         return;
     }
 
-    from_y = isize_max(from_y, 0);
-    to_y = isize_min(to_y, bitmap->height - 1);
+    canvas_clip_rows(canvas, &from_y, &to_y);
 
-    u32 *column_iter = &bitmap->pixels[from_y * bitmap->stride + x];
-    for (isize i = 0; i < to_y - from_y + 1; i += 1) {
-        *column_iter = color_blend(*column_iter, color);
-        column_iter += bitmap->stride;
+    for (isize y = from_y; y <= to_y; y += 1) {
+        canvas_emit_span(canvas, x, x, y, color, SPAN_BLEND);
     }
 }
 
-void fill_rectangle(Bitmap *bitmap, f32box2 rectangle, u32 color) {
-    // Check if rectangle is completely clamped out:
-    if (rectangle.max.x < 0 && rectangle.max.y < 0) {
-        return;
-    }
-    if (rectangle.min.x >= bitmap->width && rectangle.min.y >= bitmap->height) {
+// Both ends of the box are inclusive. An empty box is allowed.
+void fill_rectangle(
+    Canvas *canvas,
+    isize from_x, isize to_x,
+    isize from_y, isize to_y,
+    u32 color, SpanMode mode
+) {
+    if (from_x > to_x) {
         return;
     }
 
-    isize from_y = f32_max(0, rectangle.min.y);
-    isize to_y = f32_min(bitmap->height - 1, rectangle.max.y);
+    canvas_clip_rows(canvas, &from_y, &to_y);
 
     for (isize y = from_y; y <= to_y; y += 1) {
-        u32 *line = &bitmap->pixels[y * bitmap->stride];
+        canvas_emit_span(canvas, from_x, to_x, y, color, mode);
+    }
+}
+
+// Copies the bitmap into the canvas, so that its top-left corner ends up at (x, y), which may lie
+// outside of the canvas. Every pixel of the bitmap becomes a square of scale by scale pixels.
+void draw_bitmap(Canvas *canvas, Bitmap const *bitmap, isize x, isize y, int scale) {
+    if (bitmap->width <= 0) {
+        return;
+    }
 
-        isize from_x = f32_max(0, rectangle.min.x);
-        isize to_x = f32_min(bitmap->width - 1, rectangle.max.x);
+    isize from_y = y;
+    isize to_y = y + bitmap->height * scale - 1;
+    canvas_clip_rows(canvas, &from_y, &to_y);
 
-        for (isize x = from_x; x <= to_x; x += 1) {
-            line[x] = color_blend(line[x], color);
-        }
+    for (isize row = from_y; row <= to_y; row += 1) {
+        u32 const *pixels = &bitmap->pixels[(row - y) / scale * bitmap->stride];
+        canvas_emit_pixels(canvas, x, x + bitmap->width * scale - 1, row, pixels, scale);
     }
 }
 
-void draw_rectangle(Bitmap *bitmap, f32box2 rectangle, u32 color) {
+void draw_rectangle(Canvas *canvas, f32box2 rectangle, u32 color) {
     // Top and bottom horizontal lines
-    bitmap_set_row_pixels(bitmap, rectangle.min.x, rectangle.max.x, rectangle.min.y, color);
-    bitmap_set_row_pixels(bitmap, rectangle.min.x, rectangle.max.x, rectangle.max.y, color);
+    canvas_set_row_pixels(canvas, rectangle.min.x, rectangle.max.x, rectangle.min.y, color);
+    canvas_set_row_pixels(canvas, rectangle.min.x, rectangle.max.x, rectangle.max.y, color);
 
     // Left and right vertical lines
-    bitmap_set_column_pixels(bitmap, rectangle.min.x, rectangle.min.y, rectangle.max.y, color);
-    bitmap_set_column_pixels(bitmap, rectangle.max.x, rectangle.min.y, rectangle.max.y, color);
+    canvas_set_column_pixels(canvas, rectangle.min.x, rectangle.min.y, rectangle.max.y, color);
+    canvas_set_column_pixels(canvas, rectangle.max.x, rectangle.min.y, rectangle.max.y, color);
 }
 
-void draw_line(Bitmap *bitmap, f32x2 from, f32x2 to, u32 color) {
+void draw_line(Canvas *canvas, f32x2 from, f32x2 to, u32 color) {
     // Line equation: f(x, y) = Ax + By + C
     // (A, B) is a perpendicular vector. C is then derived from f(x, y) = 0.
     f32 A = to.y - from.y;
@@ -457,13 +788,7 @@ void draw_line(Bitmap *bitmap, f32x2 from, f32x2 to, u32 color) {
 
     // Single pixel special case:
     if (A == 0 && B == 0) {
-        isize x = from.x, y = from.y;
-
-        if ((0 <= x && x < bitmap->width) && (0 <= y && y < bitmap->height)) {
-            u32 *background = &bitmap->pixels[y * bitmap->stride + x];
-            *background = color_blend(*background, color);
-        }
-
+        canvas_set_pixel(canvas, from.x, from.y, color);
         return;
     }
 
@@ -481,30 +806,36 @@ void draw_line(Bitmap *bitmap, f32x2 from, f32x2 to, u32 color) {
 
     if (to.x - from.x > to.y - from.y) {
         isize from_x = f32_max(0, from.x);
-        isize to_x = f32_min(bitmap->width - 1, to.x);
+        isize to_x = f32_min(canvas->width - 1, to.x);
+
+        // Neighbouring pixels which end up on the same row are merged into a single span.
+        isize run_from_x = from_x;
+        isize run_y = 0;
         for (isize x = from_x; x <= to_x; x += 1) {
             isize y = (-A * (x + 0.5F) - C) / B + 0.5F;
 
-            if (y >= 0 && y < bitmap->height) {
-                u32 *background = &bitmap->pixels[y * bitmap->stride + x];
-                *background = color_blend(*background, color);
+            if (x == from_x) {
+                run_y = y;
+            } else if (y != run_y) {
+                canvas_set_row_pixels(canvas, run_from_x, x - 1, run_y, color);
+                run_from_x = x;
+                run_y = y;
             }
         }
+        if (from_x <= to_x) {
+            canvas_set_row_pixels(canvas, run_from_x, to_x, run_y, color);
+        }
     } else {
         isize from_y = f32_max(0, from.y);
-        isize to_y = f32_min(bitmap->height - 1, to.y);
+        isize to_y = f32_min(canvas->height - 1, to.y);
         for (isize y = from_y; y <= to_y; y += 1) {
             isize x = (-B * (y + 0.5F) - C) / A + 0.5F;
-
-            if (x >= 0 && x < bitmap->width) {
-                u32 *background = &bitmap->pixels[y * bitmap->stride + x];
-                *background = color_blend(*background, color);
-            }
+            canvas_set_pixel(canvas, x, y, color);
         }
     }
 }
 
-void draw_circle(Bitmap *bitmap, f32x2 center, f32 radius, u32 color) {
+void draw_circle(Canvas *canvas, f32x2 center, f32 radius, u32 color) {
     struct { isize x, y; } center_floored = {center.x, center.y};
     isize x = 0;
     isize y = radius;
@@ -516,19 +847,19 @@ void draw_circle(Bitmap *bitmap, f32x2 center, f32 radius, u32 color) {
     while (x <= y) {
         // Top half
 
-        bitmap_set_pixel(bitmap, center_floored.x + x, center_floored.y - y, color);
-        bitmap_set_pixel(bitmap, center_floored.x - x, center_floored.y - y, color);
+        canvas_set_pixel(canvas, center_floored.x + x, center_floored.y - y, color);
+        canvas_set_pixel(canvas, center_floored.x - x, center_floored.y - y, color);
 
-        bitmap_set_pixel(bitmap, center_floored.x + y, center_floored.y - x, color);
-        bitmap_set_pixel(bitmap, center_floored.x - y, center_floored.y - x, color);
+        canvas_set_pixel(canvas, center_floored.x + y, center_floored.y - x, color);
+        canvas_set_pixel(canvas, center_floored.x - y, center_floored.y - x, color);
 
         // Bottom half
 
-        bitmap_set_pixel(bitmap, center_floored.x + y, center_floored.y + x, color);
-        bitmap_set_pixel(bitmap, center_floored.x - y, center_floored.y + x, color);
+        canvas_set_pixel(canvas, center_floored.x + y, center_floored.y + x, color);
+        canvas_set_pixel(canvas, center_floored.x - y, center_floored.y + x, color);
 
-        bitmap_set_pixel(bitmap, center_floored.x + x, center_floored.y + y, color);
-        bitmap_set_pixel(bitmap, center_floored.x - x, center_floored.y + y, color);
+        canvas_set_pixel(canvas, center_floored.x + x, center_floored.y + y, color);
+        canvas_set_pixel(canvas, center_floored.x - x, center_floored.y + y, color);
 
         x += 1;
 
@@ -541,7 +872,7 @@ void draw_circle(Bitmap *bitmap, f32x2 center, f32 radius, u32 color) {
     }
 }
 
-void fill_circle(Bitmap *bitmap, f32x2 center, f32 radius, u32 color, bool blend) {
+void fill_circle(Canvas *canvas, f32x2 center, f32 radius, u32 color, bool blend) {
     isize x = 0;
     isize y = radius;
 
@@ -550,18 +881,18 @@ void fill_circle(Bitmap *bitmap, f32x2 center, f32 radius, u32 color, bool blend
     goto loop_start;
     while (x < y) {
         // if (x != 0)
-        bitmap_set_row_pixels(bitmap, center.x - y, center.x + y, center.y - x, color);
+        canvas_set_row_pixels(canvas, center.x - y, center.x + y, center.y - x, color);
 
         loop_start:
-        bitmap_set_row_pixels(bitmap, center.x - y, center.x + y, center.y + x, color);
+        canvas_set_row_pixels(canvas, center.x - y, center.x + y, center.y + x, color);
 
         f32 go_straight_distance = fabsf(x * x + (y + 0.5F) * (y + 0.5F) - radius_squared);
         f32 turn_distance = fabsf(x * x + (y - 0.5F) * (y - 0.5F) - radius_squared);
 
         if (turn_distance < go_straight_distance) {
             // if (x != y)
-            bitmap_set_row_pixels(bitmap, center.x - x, center.x + x, center.y - y, color);
-            bitmap_set_row_pixels(bitmap, center.x - x, center.x + x, center.y + y, color);
+            canvas_set_row_pixels(canvas, center.x - x, center.x + x, center.y - y, color);
+            canvas_set_row_pixels(canvas, center.x - x, center.x + x, center.y + y, color);
 
             y -= 1;
         }
@@ -571,285 +902,1886 @@ void fill_circle(Bitmap *bitmap, f32x2 center, f32 radius, u32 color, bool blend
 
     if (x == y) {
         if (x != 0) {
-            bitmap_set_row_pixels(bitmap, center.x - y, center.x + y, center.y - x, color);
+            canvas_set_row_pixels(canvas, center.x - y, center.x + y, center.y - x, color);
         }
-        bitmap_set_row_pixels(bitmap, center.x - y, center.x + y, center.y + x, color);
+        canvas_set_row_pixels(canvas, center.x - y, center.x + y, center.y + x, color);
     }
 }
 
-void draw_debug_text(Bitmap *bitmap, f32x2 text_pos, char const *text) {
-    f32x2 current_pos = text_pos;
-
-    char const *text_iter = text;
-    while (*text_iter != '\0') {
-        u32 unicode_char = utf8_chop_char(&text_iter);
+// Emits the set pixels of a glyph as runs of spans, one glyph row at a time.
+static void draw_glyph(Canvas *canvas, f32x2 position, u32 const *glyph_bitmap, bool shadow) {
+    f32x2 glyph_size = {font8x8_glyph_width, font8x8_glyph_height};
 
-        if (unicode_char == '\n') {
-            int line_height = font8x8_glyph_height * 5 / 4;
+    f32box2 glyph_box = {position, f32x2_add(position, glyph_size)};
+    glyph_box = f32box2_clamp(glyph_box, (f32box2){.max = {canvas->width, canvas->height}});
 
-            current_pos.x = text_pos.x;
-            current_pos.y += line_height;
+    for (isize y = glyph_box.min.y; y < glyph_box.max.y; y += 1) {
+        isize local_y = y - position.y;
 
-            continue;
-        }
+        u32 color = 0xff000000;
+        if (!shadow) {
+            f32 local_y_norm = (f32)(font8x8_glyph_height - local_y) / font8x8_glyph_height;
 
-        f32x2 glyph_size = {font8x8_glyph_width, font8x8_glyph_height};
-        u32 *glyph_bitmap = font8x8_glyph_get(unicode_char);
-        if (glyph_bitmap == NULL) {
-            glyph_bitmap = font8x8_glyph_get(0xfffd);
-            assert(glyph_bitmap != NULL);
+            u8 shade = 192 + 64 * local_y_norm;
+            color = (u32)shade << 16 | (u32)shade << 8 | shade;
         }
 
-        f32x2 shadow_pos = current_pos;
-        shadow_pos.y += 2;
-
-        f32box2 shadow_box = {shadow_pos, f32x2_add(shadow_pos, glyph_size)};
-        shadow_box = f32box2_clamp(shadow_box, (f32box2){.max = {bitmap->width, bitmap->height}});
-
-        for (isize y = shadow_box.min.y; y < shadow_box.max.y; y += 1) {
-            for (isize x = shadow_box.min.x; x < shadow_box.max.x; x += 1) {
-                isize local_x = x - shadow_pos.x;
-                isize local_y = y - shadow_pos.y;
+        isize run_from_x = -1;
+        isize x = glyph_box.min.x;
+        for (; x < glyph_box.max.x; x += 1) {
+            isize local_x = x - position.x;
 
-                if ((glyph_bitmap[local_y * font8x8_glyph_width + local_x] & 0xffffffff) != 0) {
-                    bitmap->pixels[y * bitmap->stride + x] = 0xff000000;
+            if ((glyph_bitmap[local_y * font8x8_glyph_width + local_x] & 0xffffffff) != 0) {
+                if (run_from_x == -1) {
+                    run_from_x = x;
                 }
+            } else if (run_from_x != -1) {
+                canvas_emit_span(canvas, run_from_x, x - 1, y, color, SPAN_COPY);
+                run_from_x = -1;
             }
         }
-
-        f32box2 glyph_box = {current_pos, f32x2_add(current_pos, glyph_size)};
-        glyph_box = f32box2_clamp(glyph_box, (f32box2){.max = {bitmap->width, bitmap->height}});
-
-        for (isize y = glyph_box.min.y; y < glyph_box.max.y; y += 1) {
-            for (isize x = glyph_box.min.x; x < glyph_box.max.x; x += 1) {
-                isize local_x = x - current_pos.x;
-                isize local_y = y - current_pos.y;
-
-                if ((glyph_bitmap[local_y * font8x8_glyph_width + local_x] & 0xffffffff) != 0) {
-                    f32 local_y_norm = (f32)(font8x8_glyph_height - local_y) / font8x8_glyph_height;
-
-                    u8 shade = 192 + 64 * local_y_norm;
-                    u32 color = (u32)shade << 16 | (u32)shade << 8 | shade;
-
-                    bitmap->pixels[y * bitmap->stride + x] = color;
-                }
-            }
+        if (run_from_x != -1) {
+            canvas_emit_span(canvas, run_from_x, x - 1, y, color, SPAN_COPY);
         }
-
-        current_pos.x += font8x8_glyph_width;
     }
 }
 
-typedef struct {
-    f32x2 center;
-    f32x2 size;
-    f32x2 velocity;
-
-    f32x2 render_size;
+// Instead of being drawn right away, everything within a frame is first recorded into a draw list,
+// which then gets rasterized tile by tile.
+
+typedef enum {
+    DRAW_FILL_RECTANGLE,
+    DRAW_FRAME,
+    DRAW_CIRCLE,
+    DRAW_GLYPH_RUN,
+    DRAW_LINE,
+    DRAW_BITMAP,
+} DrawCommandType;
+
+// See TILE_HISTORY_MAX_TILE_COUNT.
+typedef struct TileHistory TileHistory;
+struct TileHistory {
+    // Zero means that nothing is known about the tile.
+    u64 *hashes;
+
+    // Both are zero until the history gets adopted by the next rasterized frame.
+    isize tiles_x;
+    isize tiles_y;
+};
 
-    struct {
-        bool top;
-        bool right;
-        bool bottom;
-        bool left;
-    } damaging_side;
+static bool tile_history_area_hash(
+    TileHistory const *history,
+    isize min_x, isize min_y,
+    isize max_x, isize max_y,
+    u64 *hash
+);
 
-    bool hidden;
-    bool dynamic;
-    bool disabled;
-} Rectangle;
+typedef struct DrawCommand DrawCommand;
 
-static inline f32box2 rectangle_box(Rectangle const *rectangle) {
-    f32box2 box = {
-        .min = f32x2_sub(rectangle->center, f32x2_scale(rectangle->size, 0.5F)),
-        .max = f32x2_add(rectangle->center, f32x2_scale(rectangle->size, 0.5F)),
-    };
+struct DrawCommand {
+    DrawCommand *next;
+    DrawCommandType type;
 
-    return box;
-}
+    // The viewport the command was recorded into, relative to the span buffer.
+    int x, y;
+    int width, height;
 
-void draw_rectangle_entity(Bitmap *bitmap, Rectangle const *rectangle) {
-    // Round when scaling or doing computations to tolerate floating point errors.
-    // Floor later when drawing for simplicity.
-    f32box2 box = {
-        .min = f32x2_sub(rectangle->center, f32x2_scale(rectangle->render_size, 0.5F)),
-        .max = f32x2_add(rectangle->center, f32x2_scale(rectangle->render_size, 0.5F)),
+    // Pixels which the command might touch, relative to the span buffer (both ends are inclusive).
+    struct {
+        i32 min_x, min_y;
+        i32 max_x, max_y;
+    } bounds;
+
+    union {
+        struct {
+            isize from_x, to_x;
+            isize from_y, to_y;
+            u32 color;
+            SpanMode mode;
+        } fill_rectangle;
+
+        struct {
+            f32box2 box;
+            u32 color;
+        } frame;
+
+        struct {
+            f32x2 center;
+            f32 radius;
+            u32 color;
+            bool filled;
+        } circle;
+
+        // A single line of debug text.
+        struct {
+            f32x2 position;
+            u32 const **glyphs;
+            isize glyph_count;
+        } glyph_run;
+
+        struct {
+            f32x2 from;
+            f32x2 to;
+            u32 color;
+        } line;
+
+        // The pixels have to stay untouched until the frame is rasterized.
+        struct {
+            Bitmap bitmap;
+            // What has been rasterized into the bitmap, if it's known.
+            TileHistory const *history;
+            // Position of the top-left corner within the viewport.
+            i32 x, y;
+            int scale;
+        } bitmap;
     };
-    box.min = f32x2_round(f32x2_scale(box.min, bitmap->height));
-    box.max = f32x2_round(f32x2_scale(box.max, bitmap->height));
+};
 
-    fill_rectangle(bitmap, box, ACTIVE_COLOR);
+#if defined(__GNUC__) || defined(__clang__)
 
-    isize border_size = isize_clamp(bitmap->width * 0.01F, 4, 16);
-    for (isize i = 0; i < border_size; i += 1) {
-        f32box2 frame_box = box;
-        frame_box.min = f32x2_add(frame_box.min, (f32x2){i, i});
-        frame_box.max = f32x2_sub(frame_box.max, (f32x2){i, i});
-        if (frame_box.min.x > frame_box.max.x || frame_box.min.y > frame_box.max.y) {
-            break;
-        }
+// Returns the value before the addition.
+static isize isize_atomic_fetch_add(isize volatile *target, isize value) {
+    return __atomic_fetch_add(target, value, __ATOMIC_RELAXED);
+}
 
-        draw_rectangle(bitmap, frame_box, 0xfff1b46c);
+#elif defined(_MSC_VER)
 
-        u32 const RED_COLOR = 0xffc3604a;
-        if (rectangle->damaging_side.top) {
-            bitmap_set_row_pixels(
-                bitmap, frame_box.min.x, frame_box.max.x, frame_box.min.y, RED_COLOR
-            );
-        }
-        if (rectangle->damaging_side.right) {
-            bitmap_set_column_pixels(
-                bitmap, frame_box.max.x, frame_box.min.y, frame_box.max.y, RED_COLOR
-            );
-        }
-        if (rectangle->damaging_side.bottom) {
-            bitmap_set_row_pixels(
-                bitmap, frame_box.min.x, frame_box.max.x, frame_box.max.y, RED_COLOR
-            );
-        }
-        if (rectangle->damaging_side.left) {
-            bitmap_set_column_pixels(
-                bitmap, frame_box.min.x, frame_box.min.y, frame_box.max.y, RED_COLOR
-            );
-        }
-    }
+#include <intrin.h>
+
+static isize isize_atomic_fetch_add(isize volatile *target, isize value) {
+    return _InterlockedExchangeAdd64((__int64 volatile *)target, value);
 }
 
-typedef struct Particle Particle;
+#endif
 
-struct Particle {
-    Particle *next;
+// Memory for draw commands, shared by all of the draw lists of a frame. Lists take whole chunks
+// from it with a single atomic add and then allocate from their current chunk without any
+// synchronization, so different threads can record into different lists at the same time.
 
-    f32x2 position;
-    f32x2 velocity;
-    f32 size;
-    u32 color;
+#define DRAW_COMMAND_CHUNK_SIZE (64 * 1024)
 
-    f32 time;
-    f32 lifetime;
-};
+typedef struct {
+    u8 *memory;
+    isize capacity;
+    isize volatile used;
+} DrawCommandMemory;
 
-#define PARTICLE_POOL_CAPACITY 128
+void draw_command_memory_create(Arena *arena, isize capacity, DrawCommandMemory *memory) {
+    memory->memory = arena_alloc(arena, capacity);
+    memory->capacity = capacity;
+    memory->used = 0;
+}
 
+// Only a single thread may record into a list at a time. Lists recorded on different threads can
+// be joined together afterwards with draw_list_append.
 typedef struct {
-    Particle *particles;
-    isize capacity;
+    DrawCommandMemory *memory;
+    Arena chunk;
+
+    DrawCommand *first;
+    DrawCommand *last;
+    isize command_count;
+} DrawList;
+
+void draw_list_create(DrawCommandMemory *memory, DrawList *list) {
+    list->memory = memory;
+    list->chunk = (Arena){NULL, NULL};
+    list->first = NULL;
+    list->last = NULL;
+    list->command_count = 0;
+}
 
-    Particle *active_list;
-    Particle *free_list;
-} ParticlePool;
+static void *draw_list_alloc(DrawList *list, isize size) {
+    if (size == 0) {
+        return NULL;
+    }
 
-void particle_pool_create(Arena *arena, ParticlePool *pool) {
-    pool->capacity = PARTICLE_POOL_CAPACITY;
-    pool->particles = arena_alloc(arena, pool->capacity * sizeof(Particle));
-    memset(pool->particles, 0, pool->capacity * sizeof(Particle));
+    isize padding = (~(uptr)list->chunk.begin + 1) & (ARENA_ALIGNMENT - 1);
+    if (list->chunk.end - list->chunk.begin - padding < size) {
+        // Larger allocations get a chunk of their own.
+        isize chunk_size = isize_max(DRAW_COMMAND_CHUNK_SIZE, size + ARENA_ALIGNMENT);
 
-    pool->active_list = NULL;
+        DrawCommandMemory *memory = list->memory;
+        isize chunk_offset = isize_atomic_fetch_add(&memory->used, chunk_size);
+        if (chunk_offset + chunk_size > memory->capacity) {
+            abort();
+        }
 
-    pool->free_list = NULL;
-    for (isize i = 0; i < pool->capacity; i += 1) {
-        pool->particles[i].next = pool->free_list;
-        pool->free_list = &pool->particles[i];
+        list->chunk.begin = memory->memory + chunk_offset;
+        list->chunk.end = list->chunk.begin + chunk_size;
     }
+
+    return arena_alloc(&list->chunk, size);
 }
 
-Particle *particle_pool_get(ParticlePool *pool) {
-    if (pool->free_list == NULL) {
-        return NULL;
+// Moves all of the commands of the other list to the end of the list, keeping their order.
+void draw_list_append(DrawList *list, DrawList *other) {
+    if (other->first == NULL) {
+        return;
     }
 
-    Particle *particle = pool->free_list;
-    pool->free_list = pool->free_list->next;
-
-    particle->next = pool->active_list;
-    pool->active_list = particle;
+    if (list->last == NULL) {
+        list->first = other->first;
+    } else {
+        list->last->next = other->first;
+    }
+    list->last = other->last;
+    list->command_count += other->command_count;
 
-    return particle;
+    other->first = NULL;
+    other->last = NULL;
+    other->command_count = 0;
 }
 
-void particle_explosion_spawn(f32x2 position, PCG32 *rng, ParticlePool *pool) {
-    isize particle_count = 20 + 20 * f64_random(rng);
-    for (isize i = 0; i < particle_count; i += 1) {
-        Particle *particle = particle_pool_get(pool);
-        if (particle == NULL) {
-            break;
+// A rectangular area of the frame which commands get recorded into. Same as with the canvas,
+// coordinates are relative to its top-left corner and everything outside of it gets clipped away.
+typedef struct {
+    DrawList *list;
+    int x, y;
+    int width, height;
+} Viewport;
+
+static inline Viewport sub_viewport(Viewport const *viewport, f32box2 box) {
+    assert(box.min.x >= 0 && box.min.y >= 0);
+    isize from_x = (isize)box.min.x;
+    isize from_y = (isize)box.min.y;
+
+    assert(box.max.x < viewport->width && box.max.y < viewport->height);
+    isize to_x = (isize)box.max.x;
+    isize to_y = (isize)box.max.y;
+
+    return (Viewport){
+        .list = viewport->list,
+        .x = viewport->x + from_x,
+        .y = viewport->y + from_y,
+        .width = to_x - from_x + 1,
+        .height = to_y - from_y + 1,
+    };
+}
+
+// Returns NULL if the command would be completely clipped away, so there is no need to record it.
+static DrawCommand *viewport_push_command(
+    Viewport *viewport,
+    DrawCommandType type,
+    isize min_x, isize min_y,
+    isize max_x, isize max_y
+) {
+    min_x = isize_max(min_x, 0);
+    min_y = isize_max(min_y, 0);
+    max_x = isize_min(max_x, viewport->width - 1);
+    max_y = isize_min(max_y, viewport->height - 1);
+    if (min_x > max_x || min_y > max_y) {
+        return NULL;
+    }
+
+    DrawCommand *command = draw_list_alloc(viewport->list, sizeof(DrawCommand));
+    command->next = NULL;
+    command->type = type;
+
+    command->x = viewport->x;
+    command->y = viewport->y;
+    command->width = viewport->width;
+    command->height = viewport->height;
+
+    command->bounds.min_x = viewport->x + min_x;
+    command->bounds.min_y = viewport->y + min_y;
+    command->bounds.max_x = viewport->x + max_x;
+    command->bounds.max_y = viewport->y + max_y;
+
+    DrawList *list = viewport->list;
+    if (list->last == NULL) {
+        list->first = command;
+    } else {
+        list->last->next = command;
+    }
+    list->last = command;
+    list->command_count += 1;
+
+    return command;
+}
+
+void record_fill_rectangle(
+    Viewport *viewport,
+    isize from_x, isize to_x,
+    isize from_y, isize to_y,
+    u32 color, SpanMode mode
+) {
+    DrawCommand *command = viewport_push_command(
+        viewport, DRAW_FILL_RECTANGLE, from_x, from_y, to_x, to_y
+    );
+    if (command == NULL) {
+        return;
+    }
+
+    command->fill_rectangle.from_x = from_x;
+    command->fill_rectangle.to_x = to_x;
+    command->fill_rectangle.from_y = from_y;
+    command->fill_rectangle.to_y = to_y;
+    command->fill_rectangle.color = color;
+    command->fill_rectangle.mode = mode;
+}
+
+void record_frame(Viewport *viewport, f32box2 box, u32 color) {
+    DrawCommand *command = viewport_push_command(
+        viewport, DRAW_FRAME, box.min.x, box.min.y, box.max.x, box.max.y
+    );
+    if (command == NULL) {
+        return;
+    }
+
+    command->frame.box = box;
+    command->frame.color = color;
+}
+
+void record_circle(Viewport *viewport, f32x2 center, f32 radius, u32 color, bool filled) {
+    DrawCommand *command = viewport_push_command(
+        viewport,
+        DRAW_CIRCLE,
+        floorf(center.x - radius) - 1, floorf(center.y - radius) - 1,
+        ceilf(center.x + radius) + 1, ceilf(center.y + radius) + 1
+    );
+    if (command == NULL) {
+        return;
+    }
+
+    command->circle.center = center;
+    command->circle.radius = radius;
+    command->circle.color = color;
+    command->circle.filled = filled;
+}
+
+void record_glyph_run(
+    Viewport *viewport,
+    f32x2 position,
+    u32 const **glyphs, isize glyph_count
+) {
+    if (glyph_count == 0) {
+        return;
+    }
+
+    // Glyphs at fractional positions may cover one more pixel, and there is also a shadow below.
+    DrawCommand *command = viewport_push_command(
+        viewport,
+        DRAW_GLYPH_RUN,
+        floorf(position.x),
+        floorf(position.y),
+        ceilf(position.x) + glyph_count * font8x8_glyph_width,
+        ceilf(position.y) + font8x8_glyph_height + 2
+    );
+    if (command == NULL) {
+        return;
+    }
+
+    command->glyph_run.position = position;
+    command->glyph_run.glyphs = glyphs;
+    command->glyph_run.glyph_count = glyph_count;
+}
+
+void record_line(Viewport *viewport, f32x2 from, f32x2 to, u32 color) {
+    DrawCommand *command = viewport_push_command(
+        viewport,
+        DRAW_LINE,
+        floorf(f32_min(from.x, to.x)) - 1, floorf(f32_min(from.y, to.y)) - 1,
+        ceilf(f32_max(from.x, to.x)) + 1, ceilf(f32_max(from.y, to.y)) + 1
+    );
+    if (command == NULL) {
+        return;
+    }
+
+    command->line.from = from;
+    command->line.to = to;
+    command->line.color = color;
+}
+
+// See draw_bitmap. With the history of the bitmap, only the tiles of the frame which the changed
+// parts of the bitmap end up in get rasterized anew.
+void record_bitmap(
+    Viewport *viewport,
+    Bitmap const *bitmap, TileHistory const *history,
+    isize x, isize y, int scale
+) {
+    DrawCommand *command = viewport_push_command(
+        viewport,
+        DRAW_BITMAP,
+        x, y,
+        x + bitmap->width * scale - 1, y + bitmap->height * scale - 1
+    );
+    if (command == NULL) {
+        return;
+    }
+
+    command->bitmap.bitmap = *bitmap;
+    command->bitmap.history = history;
+    command->bitmap.x = x;
+    command->bitmap.y = y;
+    command->bitmap.scale = scale;
+}
+
+void draw_debug_text(Viewport *viewport, f32x2 text_pos, char const *text) {
+    // Glyphs are looked up once when recording. Each line of text becomes a separate glyph run.
+    u32 const **glyphs = draw_list_alloc(viewport->list, utf8_char_count(text) * sizeof(u32 *));
+    isize glyph_count = 0;
+
+    f32x2 line_pos = text_pos;
+    isize line_start = 0;
+
+    char const *text_iter = text;
+    while (*text_iter != '\0') {
+        u32 unicode_char = utf8_chop_char(&text_iter);
+
+        if (unicode_char == '\n') {
+            int line_height = font8x8_glyph_height * 5 / 4;
+
+            record_glyph_run(viewport, line_pos, &glyphs[line_start], glyph_count - line_start);
+            line_start = glyph_count;
+
+            line_pos.y += line_height;
+
+            continue;
+        }
+
+        u32 *glyph_bitmap = font8x8_glyph_get(unicode_char);
+        if (glyph_bitmap == NULL) {
+            glyph_bitmap = font8x8_glyph_get(0xfffd);
+            assert(glyph_bitmap != NULL);
+        }
+        glyphs[glyph_count++] = glyph_bitmap;
+    }
+
+    record_glyph_run(viewport, line_pos, &glyphs[line_start], glyph_count - line_start);
+}
+
+// Commands which go through the same rasterization loop.
+typedef enum {
+    DRAW_BATCH_BITMAP,
+    DRAW_BATCH_OPAQUE_FILL,
+    DRAW_BATCH_ALPHA_FILL,
+    DRAW_BATCH_FRAME,
+    DRAW_BATCH_SPRITE,
+    DRAW_BATCH_TEXT,
+    DRAW_BATCH_LINE,
+
+    DRAW_BATCH_COUNT,
+} DrawBatch;
+
+static DrawBatch draw_command_batch(DrawCommand const *command) {
+    switch (command->type) {
+    case DRAW_FILL_RECTANGLE: {
+        bool opaque =
+            command->fill_rectangle.mode == SPAN_COPY ||
+            (command->fill_rectangle.color >> 24) == 0xff;
+
+        return opaque ? DRAW_BATCH_OPAQUE_FILL : DRAW_BATCH_ALPHA_FILL;
+    } break;
+
+    case DRAW_FRAME: {
+        return DRAW_BATCH_FRAME;
+    } break;
+
+    case DRAW_CIRCLE: {
+        return DRAW_BATCH_SPRITE;
+    } break;
+
+    case DRAW_GLYPH_RUN: {
+        return DRAW_BATCH_TEXT;
+    } break;
+
+    case DRAW_LINE: {
+        return DRAW_BATCH_LINE;
+    } break;
+
+    case DRAW_BITMAP: {
+        return DRAW_BATCH_BITMAP;
+    } break;
+    }
+
+    assert(false);
+    return DRAW_BATCH_OPAQUE_FILL;
+}
+
+static int u64_compare(void const *left, void const *right) {
+    u64 left_value = *(u64 const *)left;
+    u64 right_value = *(u64 const *)right;
+
+    return (left_value > right_value) - (left_value < right_value);
+}
+
+#define DRAW_LIST_SORT_CELL_SIZE 64
+
+// Reorders the list, so that the commands of each batch get executed back to back.
+//
+// Every command is put into a layer above all of the earlier commands it might overlap, except for
+// the ones from the same batch: those keep their order anyway, because sorting is done by layer,
+// then by batch, then by the original position. That way the order only changes for the commands
+// which don't overlap, and the resulting frame stays exactly the same.
+//
+// Overlaps are checked against a coarse grid of cells, which is conservative but keeps the sorting
+// linear in the number of commands.
+void draw_list_sort(DrawList *list, Arena scratch, int width, int height) {
+    isize command_count = list->command_count;
+    if (command_count < 2) {
+        return;
+    }
+
+    isize cells_x = (width + DRAW_LIST_SORT_CELL_SIZE - 1) / DRAW_LIST_SORT_CELL_SIZE;
+    isize cells_y = (height + DRAW_LIST_SORT_CELL_SIZE - 1) / DRAW_LIST_SORT_CELL_SIZE;
+
+    // The topmost layer of each batch within each cell, -1 if there is none.
+    isize cell_layer_count = cells_x * cells_y * DRAW_BATCH_COUNT;
+    i32 *cell_layers = arena_alloc(&scratch, cell_layer_count * sizeof(i32));
+    for (isize i = 0; i < cell_layer_count; i += 1) {
+        cell_layers[i] = -1;
+    }
+
+    DrawCommand **commands = arena_alloc(&scratch, command_count * sizeof(DrawCommand *));
+    u64 *sort_keys = arena_alloc(&scratch, command_count * sizeof(u64));
+
+    isize command_index = 0;
+    for (DrawCommand *command = list->first; command != NULL; command = command->next) {
+        assert(command->bounds.min_x >= 0 && command->bounds.max_x < width);
+        assert(command->bounds.min_y >= 0 && command->bounds.max_y < height);
+
+        isize from_cell_x = command->bounds.min_x / DRAW_LIST_SORT_CELL_SIZE;
+        isize to_cell_x = command->bounds.max_x / DRAW_LIST_SORT_CELL_SIZE;
+        isize from_cell_y = command->bounds.min_y / DRAW_LIST_SORT_CELL_SIZE;
+        isize to_cell_y = command->bounds.max_y / DRAW_LIST_SORT_CELL_SIZE;
+
+        DrawBatch batch = draw_command_batch(command);
+
+        i32 layer = 0;
+        for (isize cell_y = from_cell_y; cell_y <= to_cell_y; cell_y += 1) {
+            for (isize cell_x = from_cell_x; cell_x <= to_cell_x; cell_x += 1) {
+                i32 *layers = &cell_layers[(cell_y * cells_x + cell_x) * DRAW_BATCH_COUNT];
+
+                for (isize other_batch = 0; other_batch < DRAW_BATCH_COUNT; other_batch += 1) {
+                    if (layers[other_batch] == -1) {
+                        continue;
+                    }
+
+                    i32 above = layers[other_batch] + (other_batch == batch ? 0 : 1);
+                    if (above > layer) {
+                        layer = above;
+                    }
+                }
+            }
+        }
+
+        for (isize cell_y = from_cell_y; cell_y <= to_cell_y; cell_y += 1) {
+            for (isize cell_x = from_cell_x; cell_x <= to_cell_x; cell_x += 1) {
+                i32 *layers = &cell_layers[(cell_y * cells_x + cell_x) * DRAW_BATCH_COUNT];
+                if (layers[batch] < layer) {
+                    layers[batch] = layer;
+                }
+            }
+        }
+
+        commands[command_index] = command;
+        sort_keys[command_index] = (u64)layer << 40 | (u64)batch << 32 | (u64)command_index;
+        command_index += 1;
+    }
+
+    qsort(sort_keys, command_count, sizeof(u64), u64_compare);
+
+    list->first = commands[sort_keys[0] & 0xffffffff];
+    for (isize i = 0; i < command_count - 1; i += 1) {
+        commands[sort_keys[i] & 0xffffffff]->next = commands[sort_keys[i + 1] & 0xffffffff];
+    }
+    list->last = commands[sort_keys[command_count - 1] & 0xffffffff];
+    list->last->next = NULL;
+}
+
+// Rasterizes a command into a span buffer, the top-left corner of which lies at the given position
+// within the frame.
+void draw_command_execute(
+    DrawCommand const *command,
+    SpanBuffer *spans,
+    isize origin_x, isize origin_y
+) {
+    Canvas canvas = {
+        .spans = spans,
+        .x = command->x - origin_x,
+        .y = command->y - origin_y,
+        .width = command->width,
+        .height = command->height,
+    };
+
+    switch (command->type) {
+    case DRAW_FILL_RECTANGLE: {
+        fill_rectangle(
+            &canvas,
+            command->fill_rectangle.from_x, command->fill_rectangle.to_x,
+            command->fill_rectangle.from_y, command->fill_rectangle.to_y,
+            command->fill_rectangle.color, command->fill_rectangle.mode
+        );
+    } break;
+
+    case DRAW_FRAME: {
+        draw_rectangle(&canvas, command->frame.box, command->frame.color);
+    } break;
+
+    case DRAW_CIRCLE: {
+        if (command->circle.filled) {
+            fill_circle(
+                &canvas,
+                command->circle.center, command->circle.radius,
+                command->circle.color,
+                false
+            );
+        } else {
+            draw_circle(
+                &canvas,
+                command->circle.center, command->circle.radius,
+                command->circle.color
+            );
+        }
+    } break;
+
+    case DRAW_GLYPH_RUN: {
+        f32x2 glyph_pos = command->glyph_run.position;
+
+        for (isize i = 0; i < command->glyph_run.glyph_count; i += 1) {
+            f32x2 shadow_pos = glyph_pos;
+            shadow_pos.y += 2;
+            draw_glyph(&canvas, shadow_pos, command->glyph_run.glyphs[i], true);
+
+            draw_glyph(&canvas, glyph_pos, command->glyph_run.glyphs[i], false);
+
+            glyph_pos.x += font8x8_glyph_width;
+        }
+    } break;
+
+    case DRAW_LINE: {
+        draw_line(&canvas, command->line.from, command->line.to, command->line.color);
+    } break;
+
+    case DRAW_BITMAP: {
+        draw_bitmap(
+            &canvas,
+            &command->bitmap.bitmap,
+            command->bitmap.x, command->bitmap.y,
+            command->bitmap.scale
+        );
+    } break;
+    }
+}
+
+static inline u64 hash_combine(u64 hash, u64 value) {
+    hash = (hash ^ value) * 0x9e3779b97f4a7c15;
+    return hash ^ (hash >> 29);
+}
+
+static inline u64 f32x2_bits(f32x2 vector) {
+    u32 bits[2];
+    memcpy(bits, &vector, sizeof(bits));
+    return (u64)bits[0] << 32 | bits[1];
+}
+
+// Two commands with the same hash are expected to produce the same pixels within the tile. Returns
+// false if the pixels can't be told from the hash, because the command draws a bitmap which nothing
+// is known about.
+static bool draw_command_hash(u64 *hash_accumulator, DrawCommand const *command, f32box2 tile_box) {
+    u64 hash = *hash_accumulator;
+    hash = hash_combine(hash, command->type);
+    hash = hash_combine(hash, (u64)(u32)command->x << 32 | (u32)command->y);
+    hash = hash_combine(hash, (u64)(u32)command->width << 32 | (u32)command->height);
+    hash = hash_combine(hash, (u64)(u32)command->bounds.min_x << 32 | (u32)command->bounds.min_y);
+    hash = hash_combine(hash, (u64)(u32)command->bounds.max_x << 32 | (u32)command->bounds.max_y);
+
+    switch (command->type) {
+    case DRAW_FILL_RECTANGLE: {
+        hash = hash_combine(hash, command->fill_rectangle.from_x);
+        hash = hash_combine(hash, command->fill_rectangle.to_x);
+        hash = hash_combine(hash, command->fill_rectangle.from_y);
+        hash = hash_combine(hash, command->fill_rectangle.to_y);
+        hash = hash_combine(hash, command->fill_rectangle.color);
+        hash = hash_combine(hash, command->fill_rectangle.mode);
+    } break;
+
+    case DRAW_FRAME: {
+        hash = hash_combine(hash, f32x2_bits(command->frame.box.min));
+        hash = hash_combine(hash, f32x2_bits(command->frame.box.max));
+        hash = hash_combine(hash, command->frame.color);
+    } break;
+
+    case DRAW_CIRCLE: {
+        f32x2 radius = {command->circle.radius, 0};
+        hash = hash_combine(hash, f32x2_bits(command->circle.center));
+        hash = hash_combine(hash, f32x2_bits(radius));
+        hash = hash_combine(hash, command->circle.color);
+        hash = hash_combine(hash, command->circle.filled);
+    } break;
+
+    case DRAW_GLYPH_RUN: {
+        // Glyph bitmaps live in the font for the whole run time of the program.
+        hash = hash_combine(hash, f32x2_bits(command->glyph_run.position));
+        for (isize i = 0; i < command->glyph_run.glyph_count; i += 1) {
+            hash = hash_combine(hash, (uptr)command->glyph_run.glyphs[i]);
+        }
+    } break;
+
+    case DRAW_LINE: {
+        hash = hash_combine(hash, f32x2_bits(command->line.from));
+        hash = hash_combine(hash, f32x2_bits(command->line.to));
+        hash = hash_combine(hash, command->line.color);
+    } break;
+
+    // Without the history, only the location of the pixels is hashed, so the bitmap contents may
+    // only change along with the size of the frame, which resets the tile history anyway.
+    case DRAW_BITMAP: {
+        Bitmap const *bitmap = &command->bitmap.bitmap;
+        int scale = command->bitmap.scale;
+
+        hash = hash_combine(hash, (uptr)bitmap->pixels);
+        hash = hash_combine(hash, (u64)(u32)bitmap->width << 32 | (u32)bitmap->height);
+        hash = hash_combine(hash, bitmap->stride);
+        hash = hash_combine(hash, (u64)(u32)command->bitmap.x << 32 | (u32)command->bitmap.y);
+        hash = hash_combine(hash, scale);
+
+        TileHistory const *history = command->bitmap.history;
+        if (history != NULL) {
+            if (history->tiles_x == 0) {
+                return false;
+            }
+
+            // Part of the bitmap which lands in the tile.
+            isize bitmap_x = command->x + command->bitmap.x;
+            isize bitmap_y = command->y + command->bitmap.y;
+            isize min_x = isize_max((isize)tile_box.min.x - bitmap_x, 0) / scale;
+            isize min_y = isize_max((isize)tile_box.min.y - bitmap_y, 0) / scale;
+            isize max_x = ((isize)tile_box.max.x - bitmap_x) / scale;
+            isize max_y = ((isize)tile_box.max.y - bitmap_y) / scale;
+
+            u64 area_hash;
+            if (!tile_history_area_hash(history, min_x, min_y, max_x, max_y, &area_hash)) {
+                return false;
+            }
+            hash = hash_combine(hash, area_hash);
+        }
+    } break;
+    }
+
+    *hash_accumulator = hash;
+    return true;
+}
+
+// Scratch memory of every thread of the job system, indexed by thread index. A job works on a copy
+// of its thread's arena, so that everything it allocates is gone once it returns.
+//
+// Only fit for jobs which don't wait for other jobs: while waiting, the thread might pick up
+// another job, which would then get the same memory.
+Arena *thread_arenas_create(Arena *arena, JobSystem *jobs, isize capacity) {
+    isize thread_count = job_system_thread_count(jobs);
+    Arena *thread_arenas = arena_alloc(arena, thread_count * sizeof(Arena));
+
+    for (isize i = 0; i < thread_count; i += 1) {
+        if (!arena_create(capacity, &thread_arenas[i])) {
+            return NULL;
+        }
+    }
+
+    return thread_arenas;
+}
+
+// The frame is split into tiles, each of which gets rasterized and resolved independently: every
+// command is binned into the tiles its bounds overlap, and then tiles are spread across the
+// threads. Each tile is written by a single thread, so pixels need no synchronization.
+
+#define TILE_SIZE 64
+
+// Hashes of the commands which got rasterized into every tile of a bitmap the last time, so that
+// the tiles which would come out the same could be skipped. Only makes sense while the bitmap keeps
+// its contents, so has to be reset whenever they get lost.
+//
+// The same is kept for the window, so that only the tiles which differ from what is on screen get
+// presented.
+
+#define TILE_HISTORY_MAX_TILE_COUNT (16 * 1024)
+
+void tile_history_create(Arena *arena, TileHistory *history) {
+    history->hashes = arena_alloc(arena, TILE_HISTORY_MAX_TILE_COUNT * sizeof(u64));
+    history->tiles_x = 0;
+    history->tiles_y = 0;
+}
+
+void tile_history_reset(TileHistory *history) {
+    history->tiles_x = 0;
+    history->tiles_y = 0;
+}
+
+// Combines the hashes of the tiles which overlap the area (both ends are inclusive, and the area
+// may stick out of the bitmap). Two areas with the same hash hold the same pixels. Returns false if
+// some of the tiles are unknown. The history has to have been adopted by a frame.
+static bool tile_history_area_hash(
+    TileHistory const *history,
+    isize min_x, isize min_y,
+    isize max_x, isize max_y,
+    u64 *hash
+) {
+    assert(history->tiles_x > 0 && history->tiles_y > 0);
+
+    isize from_x = min_x / TILE_SIZE;
+    isize from_y = min_y / TILE_SIZE;
+    isize to_x = isize_min(max_x / TILE_SIZE, history->tiles_x - 1);
+    isize to_y = isize_min(max_y / TILE_SIZE, history->tiles_y - 1);
+
+    *hash = 0;
+    for (isize y = from_y; y <= to_y; y += 1) {
+        for (isize x = from_x; x <= to_x; x += 1) {
+            u64 tile_hash = history->hashes[y * history->tiles_x + x];
+            if (tile_hash == 0) {
+                return false;
+            }
+            *hash = hash_combine(*hash, tile_hash);
+        }
+    }
+
+    return true;
+}
+
+// Parts of the freshly rasterized bitmap which differ from what is on screen, as rectangles made
+// out of runs of damaged tiles. Runs spanning the same columns in consecutive rows get merged
+// together. The screen history is then updated as if the bitmap had been presented.
+isize tile_history_damage(
+    TileHistory const *bitmap_history,
+    TileHistory *screen_history,
+    Bitmap const *bitmap,
+    Arena *arena,
+    GuiRect **damage
+) {
+    if (bitmap->width <= 0 || bitmap->height <= 0) {
+        *damage = NULL;
+        return 0;
+    }
+
+    // The bitmap is too large for the history to be kept.
+    if (bitmap_history->tiles_x == 0) {
+        tile_history_reset(screen_history);
+
+        *damage = arena_alloc(arena, sizeof(GuiRect));
+        **damage = (GuiRect){0, 0, bitmap->width, bitmap->height};
+        return 1;
+    }
+
+    isize tiles_x = bitmap_history->tiles_x;
+    isize tiles_y = bitmap_history->tiles_y;
+    isize tile_count = tiles_x * tiles_y;
+
+    // Nothing is known about the screen, so all of the tiles are damaged.
+    if (screen_history->tiles_x != tiles_x || screen_history->tiles_y != tiles_y) {
+        memset(screen_history->hashes, 0, tile_count * sizeof(u64));
+        screen_history->tiles_x = tiles_x;
+        screen_history->tiles_y = tiles_y;
+    }
+
+    bool *damaged = arena_alloc(arena, tile_count * sizeof(bool));
+    for (isize i = 0; i < tile_count; i += 1) {
+        // Tiles which are unknown in the bitmap have been rasterized anew and can't be compared.
+        damaged[i] =
+            bitmap_history->hashes[i] == 0 ||
+            bitmap_history->hashes[i] != screen_history->hashes[i];
+    }
+    memcpy(screen_history->hashes, bitmap_history->hashes, tile_count * sizeof(u64));
+
+    GuiRect *rects = arena_alloc(arena, tile_count * sizeof(GuiRect));
+    isize rect_count = 0;
+
+    // Index of the last rectangle which has a run starting at the given column.
+    isize *column_rects = arena_alloc(arena, tiles_x * sizeof(isize));
+    for (isize x = 0; x < tiles_x; x += 1) {
+        column_rects[x] = -1;
+    }
+
+    for (isize y = 0; y < tiles_y; y += 1) {
+        isize x = 0;
+        while (x < tiles_x) {
+            if (!damaged[y * tiles_x + x]) {
+                x += 1;
+                continue;
+            }
+
+            isize run_end = x + 1;
+            while (run_end < tiles_x && damaged[y * tiles_x + run_end]) {
+                run_end += 1;
+            }
+
+            GuiRect rect = {
+                .x = x * TILE_SIZE,
+                .y = y * TILE_SIZE,
+                .width = isize_min(run_end * TILE_SIZE, bitmap->width) - x * TILE_SIZE,
+                .height = isize_min((y + 1) * TILE_SIZE, bitmap->height) - y * TILE_SIZE,
+            };
+
+            isize above = column_rects[x];
+            if (
+                above != -1 &&
+                rects[above].y + rects[above].height == rect.y &&
+                rects[above].width == rect.width
+            ) {
+                rects[above].height += rect.height;
+            } else {
+                column_rects[x] = rect_count;
+                rects[rect_count++] = rect;
+            }
+
+            x = run_end;
+        }
+    }
+
+    *damage = rects;
+    return rect_count;
+}
+
+typedef struct {
+    Bitmap *bitmap;
+    isize tiles_x;
+    isize tiles_y;
+
+    // Commands of the tile i are bin_commands[bin_offsets[i]..bin_offsets[i + 1]), in the order
+    // they appear in the draw list.
+    DrawCommand const **bin_commands;
+    isize *bin_offsets;
+
+    // NULL if the bitmap is too large to keep the history for.
+    TileHistory *history;
+
+    // Scratch memory of each thread, indexed by thread index.
+    Arena const *thread_arenas;
+} TiledFrame;
+
+static void tile_rasterize(void *data, isize tile_index, int thread_index) {
+    TiledFrame const *frame = data;
+
+    isize from = frame->bin_offsets[tile_index];
+    isize to = frame->bin_offsets[tile_index + 1];
+
+    isize tile_x = tile_index % frame->tiles_x * TILE_SIZE;
+    isize tile_y = tile_index / frame->tiles_x * TILE_SIZE;
+
+    f32box2 tile_box = {
+        .min = {tile_x, tile_y},
+        .max = {
+            isize_min(tile_x + TILE_SIZE, frame->bitmap->width) - 1,
+            isize_min(tile_y + TILE_SIZE, frame->bitmap->height) - 1,
+        },
+    };
+
+    if (frame->history != NULL) {
+        u64 hash = 0;
+        bool known = true;
+        for (isize i = from; i < to && known; i += 1) {
+            known = draw_command_hash(&hash, frame->bin_commands[i], tile_box);
+        }
+
+        // Whatever is left in the bitmap from the last time is exactly what would be drawn now.
+        if (known && frame->history->hashes[tile_index] == (hash | 1)) {
+            return;
+        }
+
+        // Unknown tiles get rasterized every time, and always count as damaged.
+        frame->history->hashes[tile_index] = known ? hash | 1 : 0;
+    }
+
+    // Local copy, so that everything allocated for the tile is gone once we're done with it.
+    Arena scratch = frame->thread_arenas[thread_index];
+
+    Bitmap tile_bitmap = sub_bitmap(frame->bitmap, tile_box);
+
+    SpanBuffer spans;
+    span_buffer_create(&scratch, tile_bitmap.width, tile_bitmap.height, &spans);
+
+    for (isize i = from; i < to; i += 1) {
+        draw_command_execute(frame->bin_commands[i], &spans, tile_x, tile_y);
+    }
+
+    span_buffer_resolve(&spans, &tile_bitmap);
+}
+
+// Only the tiles which have changed since the last time get rasterized, see TileHistory. The
+// history may be NULL, in which case all of the tiles are.
+void draw_list_rasterize(
+    DrawList const *list,
+    Arena scratch,
+    Bitmap *bitmap,
+    TileHistory *history,
+    JobSystem *jobs, Arena const *thread_arenas
+) {
+    if (bitmap->width <= 0 || bitmap->height <= 0) {
+        return;
+    }
+
+    TiledFrame frame = {
+        .bitmap = bitmap,
+        .tiles_x = (bitmap->width + TILE_SIZE - 1) / TILE_SIZE,
+        .tiles_y = (bitmap->height + TILE_SIZE - 1) / TILE_SIZE,
+        .thread_arenas = thread_arenas,
+    };
+    isize tile_count = frame.tiles_x * frame.tiles_y;
+
+    if (
+        history != NULL &&
+        (history->tiles_x != frame.tiles_x || history->tiles_y != frame.tiles_y)
+    ) {
+        history->tiles_x = 0;
+        history->tiles_y = 0;
+
+        if (tile_count <= TILE_HISTORY_MAX_TILE_COUNT) {
+            history->tiles_x = frame.tiles_x;
+            history->tiles_y = frame.tiles_y;
+            memset(history->hashes, 0, tile_count * sizeof(u64));
+        }
+    }
+    if (history != NULL && history->tiles_x != 0) {
+        frame.history = history;
+    }
+
+    // Count commands per tile first, then lay the bins out one after another.
+    frame.bin_offsets = arena_alloc(&scratch, (tile_count + 1) * sizeof(isize));
+    memset(frame.bin_offsets, 0, (tile_count + 1) * sizeof(isize));
+
+    for (DrawCommand const *command = list->first; command != NULL; command = command->next) {
+        isize from_tile_x = command->bounds.min_x / TILE_SIZE;
+        isize from_tile_y = command->bounds.min_y / TILE_SIZE;
+        isize to_tile_x = command->bounds.max_x / TILE_SIZE;
+        isize to_tile_y = command->bounds.max_y / TILE_SIZE;
+
+        for (isize y = from_tile_y; y <= to_tile_y; y += 1) {
+            for (isize x = from_tile_x; x <= to_tile_x; x += 1) {
+                frame.bin_offsets[y * frame.tiles_x + x + 1] += 1;
+            }
+        }
+    }
+    for (isize i = 0; i < tile_count; i += 1) {
+        frame.bin_offsets[i + 1] += frame.bin_offsets[i];
+    }
+
+    frame.bin_commands = arena_alloc(
+        &scratch,
+        frame.bin_offsets[tile_count] * sizeof(DrawCommand *)
+    );
+
+    isize *bin_sizes = arena_alloc(&scratch, tile_count * sizeof(isize));
+    memset(bin_sizes, 0, tile_count * sizeof(isize));
+
+    for (DrawCommand const *command = list->first; command != NULL; command = command->next) {
+        isize from_tile_x = command->bounds.min_x / TILE_SIZE;
+        isize from_tile_y = command->bounds.min_y / TILE_SIZE;
+        isize to_tile_x = command->bounds.max_x / TILE_SIZE;
+        isize to_tile_y = command->bounds.max_y / TILE_SIZE;
+
+        for (isize y = from_tile_y; y <= to_tile_y; y += 1) {
+            for (isize x = from_tile_x; x <= to_tile_x; x += 1) {
+                isize tile_index = y * frame.tiles_x + x;
+                frame.bin_commands[frame.bin_offsets[tile_index] + bin_sizes[tile_index]] = command;
+                bin_sizes[tile_index] += 1;
+            }
+        }
+    }
+
+    job_parallel_for(jobs, tile_count, tile_rasterize, &frame);
+}
+
+typedef struct {
+    f32x2 center;
+    f32x2 size;
+    f32x2 velocity;
+
+    f32x2 render_size;
+
+    struct {
+        bool top;
+        bool right;
+        bool bottom;
+        bool left;
+    } damaging_side;
+
+    bool hidden;
+    bool dynamic;
+    bool disabled;
+} Rectangle;
+
+static inline f32box2 rectangle_box(Rectangle const *rectangle) {
+    f32box2 box = {
+        .min = f32x2_sub(rectangle->center, f32x2_scale(rectangle->size, 0.5F)),
+        .max = f32x2_add(rectangle->center, f32x2_scale(rectangle->size, 0.5F)),
+    };
+
+    return box;
+}
+
+void draw_rectangle_entity(Viewport *viewport, Rectangle const *rectangle) {
+    // Round when scaling or doing computations to tolerate floating point errors.
+    // Floor later when drawing for simplicity.
+    f32box2 box = {
+        .min = f32x2_sub(rectangle->center, f32x2_scale(rectangle->render_size, 0.5F)),
+        .max = f32x2_add(rectangle->center, f32x2_scale(rectangle->render_size, 0.5F)),
+    };
+    box.min = f32x2_round(f32x2_scale(box.min, viewport->height));
+    box.max = f32x2_round(f32x2_scale(box.max, viewport->height));
+
+    isize from_x = box.min.x, to_x = box.max.x;
+    isize from_y = box.min.y, to_y = box.max.y;
+    if (from_x > to_x || from_y > to_y) {
+        return;
+    }
+
+    // The border can't be thicker than a half of the box, otherwise the opposite sides would
+    // overlap.
+    isize border_size = isize_clamp(viewport->width * 0.01F, 4, 16);
+    border_size = isize_min(border_size, (to_x - from_x) / 2 + 1);
+    border_size = isize_min(border_size, (to_y - from_y) / 2 + 1);
+
+    u32 const BORDER_COLOR = 0xfff1b46c;
+    u32 const RED_COLOR = 0xffc3604a;
+
+    u32 top_color = rectangle->damaging_side.top ? RED_COLOR : BORDER_COLOR;
+    u32 right_color = rectangle->damaging_side.right ? RED_COLOR : BORDER_COLOR;
+    u32 bottom_color = rectangle->damaging_side.bottom ? RED_COLOR : BORDER_COLOR;
+    u32 left_color = rectangle->damaging_side.left ? RED_COLOR : BORDER_COLOR;
+
+    // Corners go to the damaging sides, so that a red side is drawn as one solid band.
+    bool vertical_sides_own_corners =
+        rectangle->damaging_side.left || rectangle->damaging_side.right;
+
+    isize horizontal_from_x = from_x;
+    isize horizontal_to_x = to_x;
+    isize vertical_from_y = from_y;
+    isize vertical_to_y = to_y;
+    if (vertical_sides_own_corners) {
+        horizontal_from_x += border_size;
+        horizontal_to_x -= border_size;
+    } else {
+        vertical_from_y += border_size;
+        vertical_to_y -= border_size;
+    }
+
+    // Each pixel of the box gets written exactly once: four border bands and the interior.
+    record_fill_rectangle(
+        viewport,
+        horizontal_from_x, horizontal_to_x,
+        from_y, from_y + border_size - 1,
+        top_color, SPAN_COPY
+    );
+    record_fill_rectangle(
+        viewport,
+        horizontal_from_x, horizontal_to_x,
+        to_y - border_size + 1, to_y,
+        bottom_color, SPAN_COPY
+    );
+    record_fill_rectangle(
+        viewport,
+        from_x, from_x + border_size - 1,
+        vertical_from_y, vertical_to_y,
+        left_color, SPAN_COPY
+    );
+    record_fill_rectangle(
+        viewport,
+        to_x - border_size + 1, to_x,
+        vertical_from_y, vertical_to_y,
+        right_color, SPAN_COPY
+    );
+
+    record_fill_rectangle(
+        viewport,
+        from_x + border_size, to_x - border_size,
+        from_y + border_size, to_y - border_size,
+        ACTIVE_COLOR, SPAN_COPY
+    );
+}
+
+typedef struct {
+    f32x2 position;
+    f32x2 velocity;
+    f32 size;
+    u32 color;
+
+    f32 time;
+    f32 lifetime;
+} Particle;
+
+// With the default capacity a pool never holds more than a single chunk, so updates never leave
+// the calling thread. Pools only fill up past a chunk with lots of explosions going on: build with
+// -DPARTICLE_POOL_CAPACITY=131072 -DMAX_RECTANGLE_COUNT=1024 to get updates spread across threads.
+#ifndef PARTICLE_POOL_CAPACITY
+    #define PARTICLE_POOL_CAPACITY 128
+#endif
+#define PARTICLE_CHUNK_SIZE 1024
+
+// Active particles are kept packed at the beginning of the array, oldest first.
+typedef struct {
+    Particle *particles;
+    isize count;
+    isize capacity;
+
+    // Number of particles left in each chunk after an update (see particle_pool_update).
+    isize *chunk_counts;
+} ParticlePool;
+
+// How much arena memory particle_pool_create takes.
+isize particle_pool_size(isize capacity) {
+    isize max_chunk_count = (capacity + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE;
+    return capacity * sizeof(Particle) + max_chunk_count * sizeof(isize) + 2 * ARENA_ALIGNMENT;
+}
+
+void particle_pool_create(Arena *arena, isize capacity, ParticlePool *pool) {
+    pool->capacity = capacity;
+    pool->particles = arena_alloc(arena, pool->capacity * sizeof(Particle));
+    memset(pool->particles, 0, pool->capacity * sizeof(Particle));
+
+    pool->count = 0;
+
+    isize max_chunk_count = (capacity + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE;
+    pool->chunk_counts = arena_alloc(arena, max_chunk_count * sizeof(isize));
+}
+
+Particle *particle_pool_get(ParticlePool *pool) {
+    if (pool->count == pool->capacity) {
+        return NULL;
+    }
+
+    Particle *particle = &pool->particles[pool->count];
+    pool->count += 1;
+
+    return particle;
+}
+
+void particle_explosion_spawn(f32x2 position, PCG32 *rng, ParticlePool *pool) {
+    isize particle_count = 20 + 20 * f64_random(rng);
+    for (isize i = 0; i < particle_count; i += 1) {
+        Particle *particle = particle_pool_get(pool);
+        if (particle == NULL) {
+            break;
+        }
+
+        particle->position = position;
+
+        f32 velocity_angle = 2 * M_PI * f64_random(rng);
+        particle->velocity = f32x2_scale(
+            (f32x2){cosf(velocity_angle), sinf(velocity_angle)},
+            0.25F + 0.35F * f64_random(rng)
+        );
+
+        particle->size = 0.01F + 0.05F * f64_random(rng);
+
+        particle->color = ACTIVE_COLOR;
+
+        particle->time = 0.0F;
+        particle->lifetime = 0.25F + 0.5F * f64_random(rng);
+    }
+}
+
+// Particles get updated in fixed-size chunks, which run in parallel. Each chunk packs its surviving
+// particles at its own beginning, and then the chunks get glued together in order. Chunk bounds
+// don't depend on the number of threads, so the result is always the same.
+
+typedef struct {
+    ParticlePool *pool;
+    f32 dt;
+} ParticleUpdate;
+
+static void particle_chunk_update(void *data, isize chunk_index, int thread_index) {
+    (void)thread_index;
+    ParticleUpdate *update = data;
+    f32 dt = update->dt;
+
+    isize from = chunk_index * PARTICLE_CHUNK_SIZE;
+    isize to = isize_min(from + PARTICLE_CHUNK_SIZE, update->pool->count);
+    Particle *particles = update->pool->particles;
+
+    isize alive_end = from;
+    for (isize i = from; i < to; i += 1) {
+        Particle particle = particles[i];
+
+        particle.time += dt;
+        if (particle.time >= particle.lifetime) {
+            continue;
+        }
+
+        particle.position = f32x2_add(particle.position, f32x2_scale(particle.velocity, dt));
+        particle.velocity = f32x2_add(particle.velocity, f32x2_scale((f32x2){0, 0.5F}, dt));
+
+        particle.color &= 0x00ffffff;
+        particle.color |= (u32)(
+            ease_out_quadratic(1 - particle.time / particle.lifetime) * 255.0F
+        ) << 24;
+
+        particles[alive_end] = particle;
+        alive_end += 1;
+    }
+
+    update->pool->chunk_counts[chunk_index] = alive_end - from;
+}
+
+void particle_pool_update(ParticlePool *pool, f32 dt, JobSystem *jobs) {
+    if (pool->count == 0) {
+        return;
+    }
+
+    isize chunk_count = (pool->count + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE;
+
+    ParticleUpdate update = {
+        .pool = pool,
+        .dt = dt,
+    };
+    job_parallel_for(jobs, chunk_count, particle_chunk_update, &update);
+
+    // Chunks only ever shrink, so moving them down in order never overwrites anything which
+    // hasn't been moved yet.
+    isize count = pool->chunk_counts[0];
+    for (isize i = 1; i < chunk_count; i += 1) {
+        memmove(
+            &pool->particles[count],
+            &pool->particles[i * PARTICLE_CHUNK_SIZE],
+            pool->chunk_counts[i] * sizeof(Particle)
+        );
+        count += pool->chunk_counts[i];
+    }
+    pool->count = count;
+}
+
+void draw_field(
+    Viewport *viewport,
+    Rectangle const *rectangles, isize rectangle_count,
+    Particle const *particles, isize particle_count
+) {
+    for (isize i = 0; i < rectangle_count; i += 1) {
+        Rectangle rectangle = rectangles[i];
+
+        if (!rectangle.hidden) {
+            draw_rectangle_entity(viewport, &rectangle);
+        }
+    }
+
+    for (isize i = 0; i < particle_count; i += 1) {
+        record_circle(
+            viewport,
+            f32x2_scale(particles[i].position, viewport->height),
+            particles[i].size * viewport->height,
+            particles[i].color,
+            true
+        );
+    }
+}
+
+// Returns false if there is no room for the field within a frame of the given size.
+bool field_box_fit(int width, int height, f32box2 *field_box) {
+    f32x2 interior_size = {
+        width - 2 * FIELD_MARGIN,
+        height - 2 * FIELD_MARGIN,
+    };
+
+    f32 field_height = interior_size.x / FIELD_ASPECT_RATIO;
+    if (field_height > interior_size.y) {
+        field_height = interior_size.y;
+    }
+    f32 field_width = field_height * FIELD_ASPECT_RATIO;
+
+    if (field_width < 1 || field_height < 1) {
+        return false;
+    }
+
+    field_box->min = (f32x2){
+        (width - field_width) * 0.5F,
+        (height - field_height) * 0.5F,
+    };
+    field_box->max = f32x2_add(field_box->min, (f32x2){field_width - 1, field_height - 1});
+
+    return
+        field_box->min.x >= 0 && field_box->min.y >= 0 &&
+        field_box->max.x < width && field_box->max.y < height;
+}
+
+// A bitmap which gets rendered separately and then drawn into frames as a whole. The history lets
+// frames only redraw the tiles which the changed parts of the layer land in.
+typedef struct {
+    Bitmap bitmap;
+    // In pixels.
+    isize capacity;
+
+    TileHistory history;
+} Layer;
+
+void layer_create(Arena *arena, Layer *layer) {
+    layer->bitmap = (Bitmap){0};
+    layer->capacity = 0;
+    tile_history_create(arena, &layer->history);
+}
+
+// The contents are lost.
+void layer_resize(Layer *layer, int width, int height) {
+    isize pixel_count = (isize)width * height;
+    if (pixel_count > layer->capacity) {
+        free(layer->bitmap.pixels);
+
+        layer->bitmap.pixels = malloc(pixel_count * sizeof(u32));
+        if (layer->bitmap.pixels == NULL) {
+            abort();
+        }
+        layer->capacity = pixel_count;
+    }
+
+    layer->bitmap.width = width;
+    layer->bitmap.height = height;
+    layer->bitmap.stride = width;
+
+    tile_history_reset(&layer->history);
+}
+
+// Parts of the frame which only change along with its size: the background, the frame of the field
+// and the rules. They get rendered once per size, and then every frame starts off with a copy.
+void static_layer_render(
+    Layer *layer,
+    int width, int height,
+    Arena scratch,
+    JobSystem *jobs, Arena const *thread_arenas
+) {
+    layer_resize(layer, width, height);
+
+    DrawCommandMemory command_memory;
+    draw_command_memory_create(&scratch, 64 * 1024, &command_memory);
+
+    DrawList draw_list;
+    draw_list_create(&command_memory, &draw_list);
+    Viewport viewport = {&draw_list, 0, 0, width, height};
+
+    record_fill_rectangle(
+        &viewport,
+        0, viewport.width - 1,
+        0, viewport.height - 1,
+        BACKGROUND_COLOR, SPAN_COPY
+    );
+
+    f32box2 field_box;
+    if (field_box_fit(width, height, &field_box)) {
+        Viewport field_viewport = sub_viewport(&viewport, field_box);
+        record_frame(
+            &field_viewport,
+            (f32box2){{0, 0}, {field_viewport.width - 1, field_viewport.height - 1}},
+            SECONDARY_COLOR
+        );
+    }
+
+    char rules_text[] = "Красные стороны наносят урон";
+    isize rules_text_width = utf8_char_count(rules_text) * font8x8_glyph_width;
+    f32x2 rules_text_position = {
+        (viewport.width - rules_text_width) / 2.0F,
+        font8x8_glyph_height,
+    };
+    draw_debug_text(&viewport, rules_text_position, rules_text);
+
+    draw_list_sort(&draw_list, scratch, width, height);
+    draw_list_rasterize(&draw_list, scratch, &layer->bitmap, &layer->history, jobs, thread_arenas);
+}
+
+// The field at 1 / scale of the resolution of the frame (rounded up), to be upscaled into it. The
+// frame of the field is left to the static layer, so that it stays sharp.
+void field_layer_render(
+    Layer *layer,
+    int width, int height, int scale,
+    Rectangle const *rectangles, isize rectangle_count,
+    Particle const *particles, isize particle_count,
+    Arena scratch,
+    JobSystem *jobs, Arena const *thread_arenas
+) {
+    width = (width + scale - 1) / scale;
+    height = (height + scale - 1) / scale;
+    if (layer->bitmap.width != width || layer->bitmap.height != height) {
+        layer_resize(layer, width, height);
+    }
+
+    DrawCommandMemory command_memory;
+    draw_command_memory_create(&scratch, 4 * 1024 * 1024, &command_memory);
+
+    DrawList draw_list;
+    draw_list_create(&command_memory, &draw_list);
+    Viewport viewport = {&draw_list, 0, 0, width, height};
+
+    // Every pixel has to be covered, otherwise tiles would keep whatever was left in them.
+    record_fill_rectangle(
+        &viewport,
+        0, viewport.width - 1,
+        0, viewport.height - 1,
+        BACKGROUND_COLOR, SPAN_COPY
+    );
+
+    draw_field(&viewport, rectangles, rectangle_count, particles, particle_count);
+
+    draw_list_sort(&draw_list, scratch, width, height);
+    draw_list_rasterize(&draw_list, scratch, &layer->bitmap, &layer->history, jobs, thread_arenas);
+}
+
+// The game spawns up to this many rectangles (fewer if they don't fit). With the default count the
+// sweep below never leaves the calling thread: build with -DMAX_RECTANGLE_COUNT=1024 to get a field
+// of a couple hundred small rectangles, which does get spread across threads.
+#ifndef MAX_RECTANGLE_COUNT
+    #define MAX_RECTANGLE_COUNT 12
+#endif
+
+// Earliest collision of a single rectangle against all of the others.
+typedef struct {
+    f32 time;
+    Rectangle *other;
+    f32x2 normal;
+
+    // Whether the collision may be picked as the closest one.
+    bool candidate;
+} TimeOfImpact;
+
+typedef struct {
+    Rectangle *rectangles;
+    isize rectangle_count;
+    isize *iterations_without_progress;
+
+    TimeOfImpact *impacts;
+} TimeOfImpactSweep;
+
+// Rectangles are independent of each other during the sweep, so they are spread across threads
+// once there are enough of them to pay for it.
+#define PARALLEL_TIME_OF_IMPACT_MIN_COUNT 64
+
+static void rectangle_time_of_impact(void *data, isize this, int thread_index) {
+    (void)thread_index;
+
+    TimeOfImpactSweep *sweep = data;
+    Rectangle *rectangles = sweep->rectangles;
+    isize rectangle_count = sweep->rectangle_count;
+    isize *iterations_without_progress = sweep->iterations_without_progress;
+
+    TimeOfImpact *impact = &sweep->impacts[this];
+    impact->candidate = false;
+
+    f32 const TIME_EPSILON = 1e-6;
+
+    Rectangle rectangle = rectangles[this];
+
+    if (rectangle.velocity.x == 0 && rectangle.velocity.y == 0) {
+        return;
+    }
+    if (rectangle.disabled) {
+        return;
+    }
+
+    f32x2 ray_origin = rectangle.center;
+
+    f32 this_collision_time = INFINITY;
+    Rectangle *this_collision_rectangle = NULL;
+    f32x2 this_collision_normal = {0};
+
+    for (isize other = 0; other < rectangle_count; other += 1) {
+        if (this == other) {
+            continue;
+        }
+        if (rectangles[other].disabled) {
+            continue;
         }
 
-        particle->position = position;
+        f32x2 ray_direction = f32x2_sub(rectangle.velocity, rectangles[other].velocity);
 
-        f32 velocity_angle = 2 * M_PI * f64_random(rng);
-        particle->velocity = f32x2_scale(
-            (f32x2){cosf(velocity_angle), sinf(velocity_angle)},
-            0.25F + 0.35F * f64_random(rng)
+        f32box2 fat_box;
+        fat_box.min = f32x2_sub(
+            rectangle_box(&rectangles[other]).min,
+            f32x2_scale(rectangle.size, 0.5F)
+        );
+        fat_box.max = f32x2_add(
+            rectangle_box(&rectangles[other]).max,
+            f32x2_scale(rectangle.size, 0.5F)
         );
 
-        particle->size = 0.01F + 0.05F * f64_random(rng);
+        f32 near, far;
+        f32x2 normal;
+        if (ray_vs_f32box2(ray_origin, ray_direction, fat_box, &near, &far, &normal)) {
+            if (near < 0) {
+                continue;
+            }
 
-        particle->color = ACTIVE_COLOR;
+            if (near < this_collision_time) {
+                this_collision_time = near;
+                this_collision_rectangle = &rectangles[other];
+                this_collision_normal = normal;
+            }
+        }
+    }
 
-        particle->time = 0.0F;
-        particle->lifetime = 0.25F + 0.5F * f64_random(rng);
+    // If the rectangle has "bounced" 4 times without moving, this probably means that its velocity
+    // vector has come back to the original direction which we've already tried.
+    if (iterations_without_progress[this] < 4 || this_collision_time >= TIME_EPSILON) {
+        if (this_collision_time < TIME_EPSILON) {
+            iterations_without_progress[this] += 1;
+        } else {
+            iterations_without_progress[this] = 0;
+        }
+
+        impact->time = this_collision_time;
+        impact->other = this_collision_rectangle;
+        impact->normal = this_collision_normal;
+        impact->candidate = true;
     }
 }
 
-void draw_field(
-    Bitmap *bitmap,
-    Rectangle const *rectangles, isize rectangle_count,
-    Particle *particles
-) {
-    for (isize i = 0; i < rectangle_count; i += 1) {
-        Rectangle rectangle = rectangles[i];
+// Everything which gets simulated. Worlds don't share anything, so any number of them can be
+// simulated at the same time.
+typedef struct {
+    Rectangle rectangles[MAX_RECTANGLE_COUNT];
+    isize rectangle_count;
 
-        if (!rectangle.hidden) {
-            draw_rectangle_entity(bitmap, &rectangle);
+    ParticlePool particle_pool;
+    PCG32 rng;
+
+    // Scratch state of a single step.
+    isize iterations_without_progress[MAX_RECTANGLE_COUNT];
+    TimeOfImpact impacts[MAX_RECTANGLE_COUNT];
+
+    // Simulated time in seconds.
+    f64 time;
+    isize collision_count;
+} World;
+
+// Both worlds must have particle pools of the same capacity.
+void world_copy(World *dest, World const *source) {
+    ParticlePool dest_pool = dest->particle_pool;
+    ParticlePool const *source_pool = &source->particle_pool;
+    assert(dest_pool.capacity == source_pool->capacity);
+
+    *dest = *source;
+
+    memcpy(dest_pool.particles, source_pool->particles, source_pool->count * sizeof(Particle));
+    dest_pool.count = source_pool->count;
+    dest->particle_pool = dest_pool;
+}
+
+// Number of dynamic rectangles which haven't been destroyed yet.
+isize world_survivor_count(World const *world) {
+    isize survivor_count = 0;
+    for (isize i = 0; i < world->rectangle_count; i += 1) {
+        if (world->rectangles[i].dynamic && !world->rectangles[i].disabled) {
+            survivor_count += 1;
+        }
+    }
+
+    return survivor_count;
+}
+
+// Advances the world by dt.
+void world_step(World *world, f64 dt, JobSystem *jobs) {
+    Rectangle *rectangles = world->rectangles;
+    isize rectangle_count = world->rectangle_count;
+    ParticlePool *particle_pool = &world->particle_pool;
+
+    isize *iterations_without_progress = world->iterations_without_progress;
+    memset(iterations_without_progress, 0, sizeof(world->iterations_without_progress));
+
+    TimeOfImpact *impacts = world->impacts;
+
+    f64 time_left = dt;
+    while (time_left > 0.0) {
+        f32 closest_collision_time = INFINITY;
+
+        Rectangle *this_rectangle = NULL;
+        Rectangle *other_rectangle = NULL;
+        f32x2 collision_normal;
+
+        TimeOfImpactSweep sweep = {
+            .rectangles = rectangles,
+            .rectangle_count = rectangle_count,
+            .iterations_without_progress = iterations_without_progress,
+            .impacts = impacts,
+        };
+        if (rectangle_count >= PARALLEL_TIME_OF_IMPACT_MIN_COUNT) {
+            job_parallel_for(jobs, rectangle_count, rectangle_time_of_impact, &sweep);
+        } else {
+            for (isize this = 0; this < rectangle_count; this += 1) {
+                rectangle_time_of_impact(&sweep, this, 0);
+            }
+        }
+
+        // Same as with a serial loop, the rectangle with the lowest index wins a tie.
+        for (isize this = 0; this < rectangle_count; this += 1) {
+            TimeOfImpact impact = impacts[this];
+
+            if (impact.candidate && impact.time < closest_collision_time) {
+                closest_collision_time = impact.time;
+
+                this_rectangle = &rectangles[this];
+                other_rectangle = impact.other;
+                collision_normal = impact.normal;
+            }
+        }
+
+        // Update rectangle positions first:
+        f32 time_passed = f32_min(closest_collision_time, time_left);
+        for (isize i = 0; i < rectangle_count; i += 1) {
+            // Don't update rectangles which got stuck.
+            if (iterations_without_progress[i] > 0) {
+                continue;
+            }
+
+            f32x2 distance = f32x2_scale(rectangles[i].velocity, time_passed);
+            rectangles[i].center = f32x2_add(rectangles[i].center, distance);
+        }
+
+        // Collision happened within the current time left:
+        if (closest_collision_time <= time_left) {
+            world->collision_count += 1;
+
+            if (this_rectangle->dynamic && other_rectangle->dynamic) {
+                f32 const DECREMENT = 0.01F;
+                f32 const MIN_SIZE = 0.05F;
+
+                if (
+                    collision_normal.x < 0 && this_rectangle->damaging_side.right ||
+                    collision_normal.x > 0 && this_rectangle->damaging_side.left ||
+                    collision_normal.y < 0 && this_rectangle->damaging_side.bottom ||
+                    collision_normal.y > 0 && this_rectangle->damaging_side.top
+                ) {
+                    f32 aspect_ratio = other_rectangle->size.y / other_rectangle->size.x;
+                    other_rectangle->size.x -= DECREMENT;
+                    other_rectangle->size.y = other_rectangle->size.x * aspect_ratio;
+
+                    if (other_rectangle->size.x < MIN_SIZE) {
+                        other_rectangle->hidden = true;
+                        other_rectangle->disabled = true;
+
+                        particle_explosion_spawn(
+                            other_rectangle->center,
+                            &world->rng,
+                            particle_pool
+                        );
+                    }
+                }
+
+                if (
+                    collision_normal.x < 0 && other_rectangle->damaging_side.left ||
+                    collision_normal.x > 0 && other_rectangle->damaging_side.right ||
+                    collision_normal.y < 0 && other_rectangle->damaging_side.top ||
+                    collision_normal.y > 0 && other_rectangle->damaging_side.bottom
+                ) {
+                    f32 aspect_ratio = this_rectangle->size.y / this_rectangle->size.x;
+                    this_rectangle->size.x -= DECREMENT;
+                    this_rectangle->size.y = this_rectangle->size.x * aspect_ratio;
+
+                    if (this_rectangle->size.x < MIN_SIZE) {
+                        this_rectangle->hidden = true;
+                        this_rectangle->disabled = true;
+
+                        particle_explosion_spawn(
+                            this_rectangle->center,
+                            &world->rng,
+                            particle_pool
+                        );
+                    }
+                }
+            }
+
+            if (!other_rectangle->dynamic) {
+                f32 normal_velocity = f32x2_dot(this_rectangle->velocity, collision_normal);
+
+                f32x2 force = {0};
+                force.x = 2 * normal_velocity * collision_normal.x;
+                force.y = 2 * normal_velocity * collision_normal.y;
+
+                this_rectangle->velocity = f32x2_sub(this_rectangle->velocity, force);
+            } else {
+                f32x2 collision_tangent = {collision_normal.y, -collision_normal.x};
+
+                f32x2 this_original_velocity = this_rectangle->velocity;
+                f32x2 other_original_velocity = other_rectangle->velocity;
+
+                // Elastic collision in 1D.
+                // v1 and v2 are velocities of two balls moving towards each other.
+                // v1' and v2' are velocities after collision.
+                //
+                // Conservation of momentum:
+                // m1*v1 + m2*v2 = m1*v1' + m2*v2'
+                //
+                // Kinetic energy is conserved for a perfectly elastic collision:
+                // v1 + v1' = v2 + v2'
+                //
+                // Solving for m1=1 and m2=1 we get:
+                // v1' = v2
+                // v2' = v1
+
+                f32 tangent_velocity = f32x2_dot(this_original_velocity, collision_tangent);
+                this_rectangle->velocity = f32x2_add(
+                    f32x2_scale(
+                        collision_normal,
+                        fabsf(f32x2_dot(other_original_velocity, collision_normal))
+                    ),
+                    f32x2_scale(collision_tangent, tangent_velocity)
+                );
+                if (this_rectangle->velocity.x != 0 || this_rectangle->velocity.y != 0) {
+                    // Keep the original velocity magnitude.
+                    this_rectangle->velocity = f32x2_scale(
+                        this_rectangle->velocity,
+                        f32x2_length(this_original_velocity) /
+                            f32x2_length(this_rectangle->velocity)
+                    );
+                }
+
+                tangent_velocity = f32x2_dot(other_original_velocity, collision_tangent);
+                other_rectangle->velocity = f32x2_add(
+                    f32x2_scale(
+                        collision_normal,
+                        -fabsf(f32x2_dot(this_original_velocity, collision_normal))
+                    ),
+                    f32x2_scale(collision_tangent, tangent_velocity)
+                );
+                if (other_rectangle->velocity.x != 0 || other_rectangle->velocity.y != 0) {
+                    // Keep the original velocity magnitude.
+                    other_rectangle->velocity = f32x2_scale(
+                        other_rectangle->velocity,
+                        f32x2_length(other_original_velocity) /
+                            f32x2_length(other_rectangle->velocity)
+                    );
+                }
+            }
         }
+
+        time_left -= time_passed;
     }
 
-    Particle *particle_iter = particles;
-    while (particle_iter != NULL) {
-        fill_circle(
-            bitmap,
-            f32x2_scale(particle_iter->position, bitmap->height),
-            particle_iter->size * bitmap->height,
-            particle_iter->color,
-            false
+    for (isize i = 0; i < rectangle_count; i += 1) {
+        if (rectangles[i].hidden || rectangles[i].disabled) {
+            continue;
+        }
+
+        rectangles[i].render_size = f32x2_max(
+            rectangles[i].size,
+            f32x2_sub(rectangles[i].render_size, (f32x2){7.5e-2F * dt, 7.5e-2F * dt})
         );
-        particle_iter = particle_iter->next;
     }
 
-    draw_rectangle(
-        bitmap,
-        (f32box2){{0, 0}, {bitmap->width - 1, bitmap->height - 1}},
-        SECONDARY_COLOR
-    );
+    particle_pool_update(particle_pool, dt, jobs);
+
+    world->time += dt;
 }
 
-#ifdef _WIN32
-int WinMain(void) {
-#else
-int main(void) {
-#endif
-    isize arena_capacity = 64 * 1024;
-    u8 *arena_memory = malloc(arena_capacity);
-    Arena arena = {arena_memory, arena_memory + arena_capacity};
-    if (arena.begin == NULL) {
-        return 1;
-    }
+typedef struct {
+    World *world;
+    f64 dt;
+    JobSystem *jobs;
+} Simulation;
+
+// Runs a step as a job, so that it could overlap with rendering.
+static void world_simulate(void *data, isize index, int thread_index) {
+    (void)index;
+    (void)thread_index;
+
+    Simulation *simulation = data;
+    world_step(simulation->world, simulation->dt, simulation->jobs);
+}
 
-    GuiWindow *window = gui_window_create(1280, 720, "brainrot", &arena);
-    if (window == NULL) {
-        return 1;
-    }
-    gui_window_set_target_fps(window, 60.0);
+// Generates a new world with randomly placed rectangles.
+void world_create(Arena *arena, isize particle_capacity, u64 seed, World *world) {
+    memset(world, 0, sizeof(World));
+    particle_pool_create(arena, particle_capacity, &world->particle_pool);
 
-    PCG32 rng;
-    pcg32_init(&rng, (u64)time(NULL));
+    PCG32 *rng = &world->rng;
+    pcg32_init(rng, seed);
 
+    Rectangle *rectangles = world->rectangles;
     isize rectangle_count = 0;
-    Rectangle rectangles[12];
 
     // At least 4 rectangles for the field boundaries.
-    assert(countof(rectangles) >= 4);
+    assert(MAX_RECTANGLE_COUNT >= 4);
 
     f32box2 left_boundary_box = {{-FIELD_ASPECT_RATIO, 0}, {0, 1}};
     rectangles[rectangle_count++] = (Rectangle){
@@ -880,15 +2812,15 @@ int main(void) {
     };
 
     isize give_up_counter = 0;
-    while (rectangle_count < countof(rectangles)) {
+    while (rectangle_count < MAX_RECTANGLE_COUNT) {
         retry_rectangle_generation:
         give_up_counter += 1;
-        if (give_up_counter > countof(rectangles) * 4) {
+        if (give_up_counter > MAX_RECTANGLE_COUNT * 4) {
             break;
         }
 
         // Try to find a top-left corner position which is not yet occupied by any rectangle:
-        f32x2 min_position = {f64_random(&rng) * (FIELD_ASPECT_RATIO), f64_random(&rng)};
+        f32x2 min_position = {f64_random(rng) * (FIELD_ASPECT_RATIO), f64_random(rng)};
         for (isize i = 0; i < rectangle_count; i += 1) {
             if (f32box2_contains(rectangle_box(&rectangles[i]), min_position)) {
                 goto retry_rectangle_generation;
@@ -908,7 +2840,8 @@ int main(void) {
             }
         }
 
-        f32 const MIN_SIZE = 0.05F;
+        // Shrinks along with the room each rectangle gets, so that larger counts still fit.
+        f32 const MIN_SIZE = 0.05F * sqrtf(12.0F / MAX_RECTANGLE_COUNT);
         if (
             max_position.x - min_position.x < MIN_SIZE ||
             max_position.y - min_position.y < MIN_SIZE
@@ -919,9 +2852,9 @@ int main(void) {
         f32 const MIN_ASPECT_RATIO = 0.75F;
         f32 const MAX_ASPECT_RATIO = 1.25F;
         f32 aspect_ratio =
-            MIN_ASPECT_RATIO + f64_random(&rng) * (MAX_ASPECT_RATIO - MIN_ASPECT_RATIO);
+            MIN_ASPECT_RATIO + f64_random(rng) * (MAX_ASPECT_RATIO - MIN_ASPECT_RATIO);
 
-        f32 size_x = MIN_SIZE + f64_random(&rng) * (max_position.x - min_position.x);
+        f32 size_x = MIN_SIZE + f64_random(rng) * (max_position.x - min_position.x);
         f32x2 size = { size_x, size_x * aspect_ratio };
         f32box2 box = {min_position, f32x2_add(min_position, size)};
         if (box.max.x > max_position.x || box.max.y > max_position.y) {
@@ -936,7 +2869,7 @@ int main(void) {
 
         f32x2 velocity_direction;
         {
-            f64 random = f64_random(&rng);
+            f64 random = f64_random(rng);
 
             if (random < 0.25F) {
                 velocity_direction = (f32x2){1, 1};
@@ -952,7 +2885,7 @@ int main(void) {
         }
         rectangle.velocity = f32x2_scale(velocity_direction, 0.5F);
 
-        if (f64_random(&rng) < 0.5) {
+        if (f64_random(rng) < 0.5) {
             rectangle.damaging_side.top = true;
             rectangle.damaging_side.bottom = true;
         } else {
@@ -963,326 +2896,413 @@ int main(void) {
         rectangles[rectangle_count++] = rectangle;
     }
 
-    for (isize i = 0; i < countof(rectangles); i += 1) {
+    for (isize i = 0; i < MAX_RECTANGLE_COUNT; i += 1) {
         rectangles[i].render_size = rectangles[i].size;
     }
 
-    ParticlePool particle_pool;
-    particle_pool_create(&arena, &particle_pool);
+    world->rectangle_count = rectangle_count;
+}
 
-    while (!gui_window_should_close(window)) {
-        GuiBitmap *gui_bitmap = gui_window_bitmap(window);
-        if (gui_window_resized(window)) {
-            int new_width, new_height;
-            gui_window_size(window, &new_width, &new_height);
+// Headless mode for parameter sweeps: simulates a batch of worlds with consecutive seeds at a fixed
+// time step, without rendering anything, and prints aggregate statistics. Every world runs as a
+// separate job from start to finish.
 
-            gui_bitmap_resize(gui_bitmap, new_width, new_height);
-        }
+#define BATCH_TIME_STEP (1.0 / 60.0)
 
-        Bitmap bitmap = {gui_bitmap_data(gui_bitmap)};
-        gui_bitmap_size(gui_bitmap, &bitmap.width, &bitmap.height);
-        bitmap.stride = bitmap.width;
+typedef struct {
+    isize survivor_count;
+    // When there was at most one survivor left, negative if that hasn't happened.
+    f64 last_survivor_time;
+    isize collision_count;
+} BatchResult;
 
-        f64 dt = gui_window_frame_time(window);
+typedef struct {
+    World *worlds;
+    BatchResult *results;
+    f64 duration;
+    JobSystem *jobs;
+} Batch;
 
-        bitmap_clear(&bitmap, BACKGROUND_COLOR);
+static void batch_world_run(void *data, isize index, int thread_index) {
+    (void)thread_index;
 
-        f32x2 interior_size = {
-            bitmap.width - 2 * FIELD_MARGIN,
-            bitmap.height - 2 * FIELD_MARGIN,
-        };
+    Batch *batch = data;
+    World *world = &batch->worlds[index];
+    BatchResult *result = &batch->results[index];
+
+    result->last_survivor_time = -1.0;
 
-        f32 field_height = interior_size.x / FIELD_ASPECT_RATIO;
-        if (field_height > interior_size.y) {
-            field_height = interior_size.y;
+    // Nothing can get destroyed once there is a single survivor left.
+    while (world->time < batch->duration) {
+        if (world_survivor_count(world) <= 1) {
+            result->last_survivor_time = world->time;
+            break;
         }
-        f32 field_width = field_height * FIELD_ASPECT_RATIO;
 
-        if (field_width >= 1 && field_height >= 1) {
-            f32box2 field_box;
-            field_box.min = (f32x2){
-                (bitmap.width - field_width) * 0.5F,
-                (bitmap.height - field_height) * 0.5F,
-            };
-            field_box.max = f32x2_add(field_box.min, (f32x2){field_width - 1, field_height - 1});
+        world_step(world, BATCH_TIME_STEP, batch->jobs);
+    }
 
-            if (
-                field_box.min.x >= 0 && field_box.min.y >= 0 &&
-                field_box.max.x < bitmap.width && field_box.max.y < bitmap.height
-            ) {
-                Bitmap field_bitmap = sub_bitmap(&bitmap, field_box);
-                draw_field(&field_bitmap, rectangles, rectangle_count, particle_pool.active_list);
-            }
-        }
+    result->survivor_count = world_survivor_count(world);
+    result->collision_count = world->collision_count;
+}
 
-        char rules_text[] = "Красные стороны наносят урон";
-        isize rules_text_width = utf8_char_count(rules_text) * font8x8_glyph_width;
-        f32x2 rules_text_position = {
-            (bitmap.width - rules_text_width) / 2.0F,
-            font8x8_glyph_height,
-        };
-        draw_debug_text(&bitmap, rules_text_position, rules_text);
+int batch_run(isize world_count, f64 duration, u64 first_seed) {
+    if (world_count <= 0 || !(duration > 0.0)) {
+        return 1;
+    }
 
-        gui_bitmap_render(gui_bitmap);
+    Arena arena;
+    isize world_size =
+        sizeof(World) + sizeof(BatchResult) + particle_pool_size(PARTICLE_POOL_CAPACITY) +
+        2 * ARENA_ALIGNMENT;
+    // Besides the worlds, only the job system itself goes in here: its workers live on the heap,
+    // so the size doesn't depend on the core count.
+    if (!arena_create(64 * 1024 + world_count * world_size, &arena)) {
+        return 1;
+    }
 
-        f32 const TIME_EPSILON = 1e-6;
-        isize iterations_without_progress[countof(rectangles)] = {0};
+    Batch batch = {
+        .worlds = arena_alloc(&arena, world_count * sizeof(World)),
+        .results = arena_alloc(&arena, world_count * sizeof(BatchResult)),
+        .duration = duration,
+        .jobs = job_system_create(-1, &arena),
+    };
+    if (batch.jobs == NULL) {
+        return 1;
+    }
 
-        f64 time_left = dt;
-        while (time_left > 0.0) {
-            f32 closest_collision_time = INFINITY;
+    for (isize i = 0; i < world_count; i += 1) {
+        world_create(&arena, PARTICLE_POOL_CAPACITY, first_seed + i, &batch.worlds[i]);
+    }
 
-            Rectangle *this_rectangle = NULL;
-            Rectangle *other_rectangle = NULL;
-            f32x2 collision_normal;
+    job_parallel_for(batch.jobs, world_count, batch_world_run, &batch);
 
-            for (isize this = 0; this < rectangle_count; this += 1) {
-                Rectangle rectangle = rectangles[this];
+    isize survivor_histogram[MAX_RECTANGLE_COUNT + 1] = {0};
+    isize survivor_sum = 0;
+    isize collision_sum = 0;
 
-                if (rectangle.velocity.x == 0 && rectangle.velocity.y == 0) {
-                    continue;
-                }
-                if (rectangle.disabled) {
-                    continue;
-                }
+    isize finished_count = 0;
+    f64 last_survivor_time_sum = 0.0;
+    f64 last_survivor_time_min = INFINITY;
+    f64 last_survivor_time_max = 0.0;
 
-                f32x2 ray_origin = rectangle.center;
+    for (isize i = 0; i < world_count; i += 1) {
+        BatchResult result = batch.results[i];
 
-                f32 this_collision_time = INFINITY;
-                Rectangle *this_collision_rectangle;
-                f32x2 this_collision_normal;
+        survivor_histogram[result.survivor_count] += 1;
+        survivor_sum += result.survivor_count;
+        collision_sum += result.collision_count;
 
-                for (isize other = 0; other < rectangle_count; other += 1) {
-                    if (this == other) {
-                        continue;
-                    }
-                    if (rectangles[other].disabled) {
-                        continue;
-                    }
+        if (result.last_survivor_time >= 0.0) {
+            finished_count += 1;
+            last_survivor_time_sum += result.last_survivor_time;
+            last_survivor_time_min = f64_min(last_survivor_time_min, result.last_survivor_time);
+            last_survivor_time_max = f64_max(last_survivor_time_max, result.last_survivor_time);
+        }
+    }
 
-                    f32x2 ray_direction = f32x2_sub(rectangle.velocity, rectangles[other].velocity);
+    printf(
+        "worlds: %td (seeds %llu..%llu), %.1f simulated seconds each\n",
+        world_count,
+        (unsigned long long)first_seed, (unsigned long long)(first_seed + world_count - 1),
+        duration
+    );
+    printf("survivors: %.2f on average\n", (f64)survivor_sum / world_count);
+    for (isize i = 0; i < (isize)countof(survivor_histogram); i += 1) {
+        if (survivor_histogram[i] > 0) {
+            printf("    %2td survivors: %td worlds\n", i, survivor_histogram[i]);
+        }
+    }
+    if (finished_count > 0) {
+        printf(
+            "down to a single survivor: %td worlds, after %.2f seconds on average (%.2f..%.2f)\n",
+            finished_count,
+            last_survivor_time_sum / finished_count,
+            last_survivor_time_min, last_survivor_time_max
+        );
+    } else {
+        printf("down to a single survivor: 0 worlds\n");
+    }
+    printf("collisions: %.1f per world on average\n", (f64)collision_sum / world_count);
 
-                    f32box2 fat_box;
-                    fat_box.min = f32x2_sub(
-                        rectangle_box(&rectangles[other]).min,
-                        f32x2_scale(rectangle.size, 0.5F)
-                    );
-                    fat_box.max = f32x2_add(
-                        rectangle_box(&rectangles[other]).max,
-                        f32x2_scale(rectangle.size, 0.5F)
-                    );
+    job_system_destroy(batch.jobs);
+    return 0;
+}
 
-                    f32 near, far;
-                    f32x2 normal;
-                    if (ray_vs_f32box2(ray_origin, ray_direction, fat_box, &near, &far, &normal)) {
-                        if (near < 0) {
-                            continue;
-                        }
-
-                        if (near < this_collision_time) {
-                            this_collision_time = near;
-                            this_collision_rectangle = &rectangles[other];
-                            this_collision_normal = normal;
-                        }
-                    }
-                }
+#ifdef _WIN32
+int WinMain(void) {
+    int argc = __argc;
+    char **argv = __argv;
+#else
+int main(int argc, char **argv) {
+#endif
+    // brainrot --batch [world count] [seconds per world] [first seed]
+    if (argc >= 2 && strcmp(argv[1], "--batch") == 0) {
+        isize world_count = argc >= 3 ? strtol(argv[2], NULL, 10) : 1000;
+        f64 duration = argc >= 4 ? strtod(argv[3], NULL) : 60.0;
+        u64 first_seed = argc >= 5 ? strtoull(argv[4], NULL, 10) : 1;
 
-                // If the rectangle has "bounced" 4 times without moving, this probably means that
-                // its velocity vector has come back to the original direction which we've already
-                // tried.
-                if (iterations_without_progress[this] < 4 || this_collision_time >= TIME_EPSILON) {
-                    if (this_collision_time < TIME_EPSILON) {
-                        iterations_without_progress[this] += 1;
-                    } else {
-                        iterations_without_progress[this] = 0;
-                    }
+        return batch_run(world_count, duration, first_seed);
+    }
 
-                    if (this_collision_time < closest_collision_time) {
-                        closest_collision_time = this_collision_time;
+    // brainrot --scale [1, 2 or 3]
+    //
+    // Renders the field at a fraction of the window resolution and then blows it up, which cuts the
+    // number of pixels to fill by the square of the scale. If the display server can do the blowing
+    // up, only the small field goes into bitmaps, and the rest of the frame gets handed over to the
+    // server once per window size.
+    int render_scale = 1;
+    if (argc >= 3 && strcmp(argv[1], "--scale") == 0) {
+        render_scale = isize_clamp(strtol(argv[2], NULL, 10), 1, 3);
+    }
 
-                        this_rectangle = &rectangles[this];
-                        other_rectangle = this_collision_rectangle;
-                        collision_normal = this_collision_normal;
-                    }
-                }
-            }
+    // Mostly tile histories: one per bitmap, one for the screen and one per layer, 128 KiB each,
+    // plus the particle pools of the two worlds. Nothing in here grows with the core count.
+    Arena arena;
+    if (!arena_create(1024 * 1024 + 2 * particle_pool_size(PARTICLE_POOL_CAPACITY), &arena)) {
+        return 1;
+    }
 
-            // Update rectangle positions first:
-            f32 time_passed = f32_min(closest_collision_time, time_left);
-            for (isize i = 0; i < rectangle_count; i += 1) {
-                // Don't update rectangles which got stuck.
-                if (iterations_without_progress[i] > 0) {
-                    continue;
-                }
+    // Memory which only lives for the duration of a single frame.
+    Arena frame_arena;
+    if (!arena_create(32 * 1024 * 1024, &frame_arena)) {
+        return 1;
+    }
+    Arena const empty_frame_arena = frame_arena;
 
-                f32x2 distance = f32x2_scale(rectangles[i].velocity, time_passed);
-                rectangles[i].center = f32x2_add(rectangles[i].center, distance);
-            }
+    JobSystem *jobs = job_system_create(-1, &arena);
+    if (jobs == NULL) {
+        return 1;
+    }
 
-            // Collision happened within the current time left:
-            if (closest_collision_time <= time_left) {
-                if (this_rectangle->dynamic && other_rectangle->dynamic) {
-                    f32 const DECREMENT = 0.01F;
-                    f32 const MIN_SIZE = 0.05F;
-
-                    if (
-                        collision_normal.x < 0 && this_rectangle->damaging_side.right ||
-                        collision_normal.x > 0 && this_rectangle->damaging_side.left ||
-                        collision_normal.y < 0 && this_rectangle->damaging_side.bottom ||
-                        collision_normal.y > 0 && this_rectangle->damaging_side.top
-                    ) {
-                        f32 aspect_ratio = other_rectangle->size.y / other_rectangle->size.x;
-                        other_rectangle->size.x -= DECREMENT;
-                        other_rectangle->size.y = other_rectangle->size.x * aspect_ratio;
-
-                        if (other_rectangle->size.x < MIN_SIZE) {
-                            other_rectangle->hidden = true;
-                            other_rectangle->disabled = true;
-
-                            particle_explosion_spawn(other_rectangle->center, &rng, &particle_pool);
-                        }
-                    }
+    Arena *thread_arenas = thread_arenas_create(&arena, jobs, 4 * 1024 * 1024);
+    if (thread_arenas == NULL) {
+        return 1;
+    }
 
-                    if (
-                        collision_normal.x < 0 && other_rectangle->damaging_side.left ||
-                        collision_normal.x > 0 && other_rectangle->damaging_side.right ||
-                        collision_normal.y < 0 && other_rectangle->damaging_side.top ||
-                        collision_normal.y > 0 && other_rectangle->damaging_side.bottom
-                    ) {
-                        f32 aspect_ratio = this_rectangle->size.y / this_rectangle->size.x;
-                        this_rectangle->size.x -= DECREMENT;
-                        this_rectangle->size.y = this_rectangle->size.x * aspect_ratio;
-
-                        if (this_rectangle->size.x < MIN_SIZE) {
-                            this_rectangle->hidden = true;
-                            this_rectangle->disabled = true;
-
-                            particle_explosion_spawn(this_rectangle->center, &rng, &particle_pool);
-                        }
-                    }
-                }
+    GuiWindow *window = gui_window_create(1280, 720, "brainrot", &arena);
+    if (window == NULL) {
+        return 1;
+    }
+    gui_window_set_target_fps(window, 60.0);
 
-                if (!other_rectangle->dynamic) {
-                    f32 normal_velocity = f32x2_dot(this_rectangle->velocity, collision_normal);
+    bool server_scaling =
+        render_scale > 1 &&
+        gui_window_enable_server_scaling(window, render_scale);
 
-                    f32x2 force = {0};
-                    force.x = 2 * normal_velocity * collision_normal.x;
-                    force.y = 2 * normal_velocity * collision_normal.y;
+    // What is in each of the bitmaps the window cycles through, and what is on screen.
+    GuiBitmap *history_bitmaps[GUI_MAX_BITMAP_COUNT] = {0};
+    TileHistory bitmap_histories[GUI_MAX_BITMAP_COUNT];
+    for (isize i = 0; i < GUI_MAX_BITMAP_COUNT; i += 1) {
+        tile_history_create(&arena, &bitmap_histories[i]);
+    }
+    TileHistory screen_history;
+    tile_history_create(&arena, &screen_history);
 
-                    this_rectangle->velocity = f32x2_sub(this_rectangle->velocity, force);
-                } else {
-                    f32x2 collision_tangent = {collision_normal.y, -collision_normal.x};
-
-                    f32x2 this_original_velocity = this_rectangle->velocity;
-                    f32x2 other_original_velocity = other_rectangle->velocity;
-
-                    // Elastic collision in 1D.
-                    // v1 and v2 are velocities of two balls moving towards each other.
-                    // v1' and v2' are velocities after collision.
-                    //
-                    // Conservation of momentum:
-                    // m1*v1 + m2*v2 = m1*v1' + m2*v2'
-                    //
-                    // Kinetic energy is conserved for a perfectly elastic collision:
-                    // v1 + v1' = v2 + v2'
-                    //
-                    // Solving for m1=1 and m2=1 we get:
-                    // v1' = v2
-                    // v2' = v1
-
-                    f32 tangent_velocity = f32x2_dot(this_original_velocity, collision_tangent);
-                    this_rectangle->velocity = f32x2_add(
-                        f32x2_scale(
-                            collision_normal,
-                            fabsf(f32x2_dot(other_original_velocity, collision_normal))
-                        ),
-                        f32x2_scale(collision_tangent, tangent_velocity)
-                    );
-                    if (this_rectangle->velocity.x != 0 || this_rectangle->velocity.y != 0) {
-                        // Keep the original velocity magnitude.
-                        this_rectangle->velocity = f32x2_scale(
-                            this_rectangle->velocity,
-                            f32x2_length(this_original_velocity) /
-                                f32x2_length(this_rectangle->velocity)
-                        );
-                    }
+    Layer static_layer;
+    layer_create(&arena, &static_layer);
+    Layer field_layer;
+    layer_create(&arena, &field_layer);
 
-                    tangent_velocity = f32x2_dot(other_original_velocity, collision_tangent);
-                    other_rectangle->velocity = f32x2_add(
-                        f32x2_scale(
-                            collision_normal,
-                            -fabsf(f32x2_dot(this_original_velocity, collision_normal))
-                        ),
-                        f32x2_scale(collision_tangent, tangent_velocity)
-                    );
-                    if (other_rectangle->velocity.x != 0 || other_rectangle->velocity.y != 0) {
-                        // Keep the original velocity magnitude.
-                        other_rectangle->velocity = f32x2_scale(
-                            other_rectangle->velocity,
-                            f32x2_length(other_original_velocity) /
-                                f32x2_length(other_rectangle->velocity)
-                        );
-                    }
-                }
+    // The renderer reads the front world, while the next step gets simulated in the back one.
+    World worlds[2];
+    World *front_world = &worlds[0];
+    World *back_world = &worlds[1];
+
+    world_create(&arena, PARTICLE_POOL_CAPACITY, (u64)time(NULL), front_world);
+    particle_pool_create(&arena, PARTICLE_POOL_CAPACITY, &back_world->particle_pool);
+
+    while (!gui_window_should_close(window)) {
+        frame_arena = empty_frame_arena;
+
+        f64 dt = gui_window_frame_time(window);
+
+        // The next step gets simulated while the current one is being rendered.
+        world_copy(back_world, front_world);
+        Simulation simulation = {back_world, dt, jobs};
+        Job simulation_job = {world_simulate, &simulation, 0, NULL};
+        JobCounter simulation_counter = {0};
+        job_run_on_workers(jobs, &simulation_job, 1, &simulation_counter);
+
+        // Nobody would see the frame, so the world only keeps going.
+        if (!gui_window_visible(window)) {
+            job_wait(jobs, &simulation_counter);
+
+            World *skipped_world = front_world;
+            front_world = back_world;
+            back_world = skipped_world;
+            continue;
+        }
+
+        GuiBitmap *gui_bitmap = gui_window_bitmap(window);
+
+        TileHistory *bitmap_history = NULL;
+        for (isize i = 0; i < GUI_MAX_BITMAP_COUNT; i += 1) {
+            if (history_bitmaps[i] == gui_bitmap || history_bitmaps[i] == NULL) {
+                history_bitmaps[i] = gui_bitmap;
+                bitmap_history = &bitmap_histories[i];
+                break;
             }
+        }
+        assert(bitmap_history != NULL);
 
-            time_left -= time_passed;
+        // Each of the bitmaps gets resized once it comes up after the window has been resized.
+        if (gui_window_resized(window)) {
+            tile_history_reset(&screen_history);
         }
 
-        for (isize i = 0; i < countof(rectangles); i += 1) {
-            if (rectangles[i].hidden || rectangles[i].disabled) {
-                continue;
+        int window_width, window_height;
+        gui_window_size(window, &window_width, &window_height);
+
+        // With server scaling, bitmaps only hold the field, at a fraction of its size.
+        Viewport field_area = {0};
+        int target_width = window_width;
+        int target_height = window_height;
+        if (server_scaling) {
+            Viewport window_area = {NULL, 0, 0, window_width, window_height};
+            f32box2 field_box;
+            if (field_box_fit(window_width, window_height, &field_box)) {
+                field_area = sub_viewport(&window_area, field_box);
             }
 
-            rectangles[i].render_size = f32x2_max(
-                rectangles[i].size,
-                f32x2_sub(rectangles[i].render_size, (f32x2){7.5e-2F * dt, 7.5e-2F * dt})
-            );
+            target_width = (field_area.width + render_scale - 1) / render_scale;
+            target_height = (field_area.height + render_scale - 1) / render_scale;
         }
 
-        Particle *previous_particle = NULL;
-        Particle *particle_iter = particle_pool.active_list;
-        while (particle_iter != NULL) {
-            particle_iter->time += dt;
+        int bitmap_width, bitmap_height;
+        gui_bitmap_size(gui_bitmap, &bitmap_width, &bitmap_height);
 
-            if (particle_iter->time >= particle_iter->lifetime) {
-                // Skip over with an iterator:
-                Particle *particle = particle_iter;
-                particle_iter = particle_iter->next;
+        if (bitmap_width != target_width || bitmap_height != target_height) {
+            gui_bitmap_resize(gui_bitmap, target_width, target_height);
+            tile_history_reset(bitmap_history);
+        }
 
-                // Remove from the active list:
-                if (previous_particle == NULL) {
-                    particle_pool.active_list = particle_pool.active_list->next;
-                } else {
-                    previous_particle->next = particle->next;
-                }
+        Bitmap bitmap = {gui_bitmap_data(gui_bitmap)};
+        gui_bitmap_size(gui_bitmap, &bitmap.width, &bitmap.height);
+        bitmap.stride = bitmap.width;
 
-                // Attach to the free list:
-                particle->next = particle_pool.free_list;
-                particle_pool.free_list = particle;
+        int static_width = server_scaling ? window_width : bitmap.width;
+        int static_height = server_scaling ? window_height : bitmap.height;
+        if (
+            static_layer.bitmap.width != static_width ||
+            static_layer.bitmap.height != static_height
+        ) {
+            static_layer_render(
+                &static_layer,
+                static_width, static_height,
+                frame_arena,
+                jobs, thread_arenas
+            );
 
-                continue;
+            if (server_scaling) {
+                gui_window_set_backdrop(
+                    window,
+                    static_layer.bitmap.pixels,
+                    static_layer.bitmap.width, static_layer.bitmap.height
+                );
             }
+        }
+
+        DrawCommandMemory command_memory;
+        draw_command_memory_create(&frame_arena, 8 * 1024 * 1024, &command_memory);
 
-            particle_iter->position = f32x2_add(
-                particle_iter->position,
-                f32x2_scale(particle_iter->velocity, dt)
+        DrawList draw_list;
+        draw_list_create(&command_memory, &draw_list);
+        Viewport viewport = {&draw_list, 0, 0, bitmap.width, bitmap.height};
+
+        if (server_scaling) {
+            record_fill_rectangle(
+                &viewport,
+                0, viewport.width - 1,
+                0, viewport.height - 1,
+                BACKGROUND_COLOR, SPAN_COPY
             );
-            particle_iter->velocity = f32x2_add(
-                particle_iter->velocity,
-                f32x2_scale((f32x2){0, 0.5F}, dt)
+
+            draw_field(
+                &viewport,
+                front_world->rectangles, front_world->rectangle_count,
+                front_world->particle_pool.particles, front_world->particle_pool.count
             );
+        } else {
+            record_bitmap(&viewport, &static_layer.bitmap, &static_layer.history, 0, 0, 1);
+        }
 
-            particle_iter->color &= 0x00ffffff;
-            particle_iter->color |= (u32)(
-                ease_out_quadratic(1 - particle_iter->time / particle_iter->lifetime) * 255.0F
-            ) << 24;
+        f32box2 field_box;
+        if (!server_scaling && field_box_fit(viewport.width, viewport.height, &field_box)) {
+            Viewport field_viewport = sub_viewport(&viewport, field_box);
 
-            previous_particle = particle_iter;
-            particle_iter = particle_iter->next;
+            if (render_scale == 1) {
+                draw_field(
+                    &field_viewport,
+                    front_world->rectangles, front_world->rectangle_count,
+                    front_world->particle_pool.particles, front_world->particle_pool.count
+                );
+            } else {
+                field_layer_render(
+                    &field_layer,
+                    field_viewport.width, field_viewport.height, render_scale,
+                    front_world->rectangles, front_world->rectangle_count,
+                    front_world->particle_pool.particles, front_world->particle_pool.count,
+                    frame_arena,
+                    jobs, thread_arenas
+                );
+
+                // Stays within the frame of the field.
+                f32box2 interior_box = {
+                    {1, 1},
+                    {field_viewport.width - 2, field_viewport.height - 2},
+                };
+                if (field_viewport.width > 2 && field_viewport.height > 2) {
+                    Viewport interior_viewport = sub_viewport(&field_viewport, interior_box);
+                    record_bitmap(
+                        &interior_viewport,
+                        &field_layer.bitmap, &field_layer.history,
+                        -1, -1, render_scale
+                    );
+                }
+            }
+        }
+
+        draw_list_sort(&draw_list, frame_arena, bitmap.width, bitmap.height);
+
+        draw_list_rasterize(&draw_list, frame_arena, &bitmap, bitmap_history, jobs, thread_arenas);
+
+        GuiRect *damage;
+        isize damage_count = tile_history_damage(
+            bitmap_history, &screen_history,
+            &bitmap,
+            &frame_arena,
+            &damage
+        );
+        if (server_scaling) {
+            // Stays within the frame of the field, same as the upscaled field layer.
+            GuiRect interior = {
+                field_area.x + 1, field_area.y + 1,
+                field_area.width - 2, field_area.height - 2,
+            };
+            gui_bitmap_render_scaled(
+                gui_bitmap,
+                damage, damage_count,
+                field_area.x, field_area.y, interior
+            );
+        } else {
+            gui_bitmap_render(gui_bitmap, damage, damage_count);
         }
+
+        job_wait(jobs, &simulation_counter);
+
+        World *rendered_world = front_world;
+        front_world = back_world;
+        back_world = rendered_world;
     }
 
+    int bitmap_request_count, bitmap_stall_count;
+    gui_window_bitmap_stats(window, &bitmap_request_count, &bitmap_stall_count);
+    printf(
+        "all bitmaps were busy for %d out of %d frames\n",
+        bitmap_stall_count, bitmap_request_count
+    );
+
     return 0;
 }
 
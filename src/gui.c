@@ -1,8 +1,13 @@
+// glibc only declares memfd_create and file sealing with this. Has to come before any include.
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE
+#endif
+
 #include "gui.h"
 
 #include <assert.h> // assert
-#include <stdlib.h> // abort
-#include <string.h> // memset
+#include <stdlib.h> // abort, malloc, free
+#include <string.h> // memset, memcpy
 
 // Redefinition of typedefs is a C11 feature.
 // This is the official™ guard, which is used across different headers to protect u8 and friends.
@@ -116,9 +121,50 @@ static f64 fps_counter_average(FPSCounter const *fps_counter) {
 #include <X11/extensions/XShm.h>
 
 #include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <poll.h>
+#include <unistd.h> // pipe, read, write, close
 
 #include <sys/shm.h>
 #include <sys/ipc.h>
+#include <sys/mman.h>   // memfd_create, mmap, munmap
+#include <sys/socket.h> // getsockname
+#include <fcntl.h>      // fcntl, F_ADD_SEALS
+
+// Passing bitmap memory to the server as a file descriptor (MIT-SHM 1.2) and presenting through the
+// Present extension both go through the XCB connection underneath Xlib, so they take linking with
+// -lX11-xcb -lxcb. Define GUI_XCB to turn them on. Along with it, define GUI_NO_SHM_FD to only use
+// System V segments, or GUI_NO_PRESENT to only copy bitmaps into the window.
+#ifdef GUI_XCB
+    #include <X11/Xlib-xcb.h>
+    #include <xcb/xcbext.h>
+    #include <sys/uio.h> // struct iovec
+#endif
+
+#if defined(GUI_XCB) && !defined(GUI_NO_SHM_FD)
+    #define GUI_SHM_FD
+#endif
+#if defined(GUI_XCB) && !defined(GUI_NO_PRESENT)
+    #define GUI_PRESENT
+#endif
+
+// Scaling bitmaps up on the server takes the RENDER extension, and linking with -lXrender. Define
+// GUI_RENDER to turn it on, otherwise the scaling is always left to the caller.
+#ifdef GUI_RENDER
+    #include <X11/extensions/Xrender.h>
+#endif
+
+static isize isize_atomic_load(isize volatile *source) {
+    return __atomic_load_n(source, __ATOMIC_ACQUIRE);
+}
+
+static void isize_atomic_store(isize volatile *dest, isize value) {
+    __atomic_store_n(dest, value, __ATOMIC_RELEASE);
+}
+
+// Beyond that, the bounding box of the damage gets presented instead.
+#define GUI_BITMAP_MAX_DAMAGE_COUNT 64
 
 struct GuiBitmap {
     GuiWindow *window;
@@ -126,18 +172,178 @@ struct GuiBitmap {
     isize width;
     isize height;
     XShmSegmentInfo shared_segment;
+    // Only in the GUI_PRESENT_SHM_PIXMAP mode: the same memory, as seen by the server.
+    Pixmap pixmap;
+#ifdef GUI_RENDER
+    // Only in the GUI_PRESENT_RENDER mode: the pixmap with the scaling transform attached.
+    Picture picture;
+#endif
+    // Size of the mapping, if the memory comes from a file descriptor rather than from a System V
+    // segment.
+    isize mapped_size;
     bool available;
+    // Only in the GUI_PRESENT_EXTENSION mode: the server hasn't said yet that it's done with the
+    // pixmap. Only touched by the presenter thread.
+    bool held_by_server;
+    // Value of the present counter of the window when the bitmap got presented the last time.
+    isize present_index;
+
+    // Parts of the bitmap to put into the window on the next present.
+    GuiRect damage[GUI_BITMAP_MAX_DAMAGE_COUNT];
+    isize damage_count;
+
+    // Only in the GUI_PRESENT_RENDER mode: where the bitmap goes on the next present, and whether
+    // the backdrop has to be put back around it.
+    int x, y;
+    GuiRect clip;
+    bool backdrop_damaged;
 };
 
+// Single-producer single-consumer queue of bitmaps, used for passing them between the main thread
+// and the presenter thread. The semaphore counts bitmaps in the queue, so that the consumer could
+// sleep while the queue is empty. It never overflows, because there are fewer bitmaps than slots.
+
+#define BITMAP_QUEUE_CAPACITY 4
+
+typedef struct {
+    GuiBitmap *slots[BITMAP_QUEUE_CAPACITY];
+    isize volatile head;
+    isize volatile tail;
+    sem_t count;
+} BitmapQueue;
+
+static bool bitmap_queue_init(BitmapQueue *queue) {
+    queue->head = 0;
+    queue->tail = 0;
+    return sem_init(&queue->count, 0, 0) == 0;
+}
+
+static void bitmap_queue_push(BitmapQueue *queue, GuiBitmap *bitmap) {
+    isize tail = queue->tail;
+    assert(tail - isize_atomic_load(&queue->head) < BITMAP_QUEUE_CAPACITY);
+
+    queue->slots[tail % BITMAP_QUEUE_CAPACITY] = bitmap;
+    isize_atomic_store(&queue->tail, tail + 1);
+
+    sem_post(&queue->count);
+}
+
+// Expects the semaphore to have been decremented already.
+static GuiBitmap *bitmap_queue_take(BitmapQueue *queue) {
+    isize head = queue->head;
+    assert(head < isize_atomic_load(&queue->tail));
+
+    GuiBitmap *bitmap = queue->slots[head % BITMAP_QUEUE_CAPACITY];
+    isize_atomic_store(&queue->head, head + 1);
+
+    return bitmap;
+}
+
+// Blocks until there is something in the queue.
+static GuiBitmap *bitmap_queue_pop(BitmapQueue *queue) {
+    while (sem_wait(&queue->count) != 0) {
+        // Interrupted by a signal.
+    }
+
+    return bitmap_queue_take(queue);
+}
+
+// Returns NULL if the queue is empty.
+static GuiBitmap *bitmap_queue_try_pop(BitmapQueue *queue) {
+    if (sem_trywait(&queue->count) != 0) {
+        return NULL;
+    }
+
+    return bitmap_queue_take(queue);
+}
+
+// Input events get read from the X connection on a separate thread, which translates them into
+// compact timestamped records and passes them to the main thread through a single-producer
+// single-consumer ring. The main thread drains the ring at the start of every frame.
+
+typedef enum {
+    INPUT_EVENT_MOUSE_MOVE,
+    INPUT_EVENT_BUTTON_PRESS,
+    INPUT_EVENT_BUTTON_RELEASE,
+    INPUT_EVENT_RESIZE,
+    INPUT_EVENT_EXPOSE,
+    INPUT_EVENT_MAP,
+    INPUT_EVENT_UNMAP,
+    INPUT_EVENT_VISIBILITY,
+    INPUT_EVENT_CLOSE,
+} InputEventType;
+
+typedef struct {
+    InputEventType type;
+    // Seconds since the window has been created, same as gui_window_time.
+    f64 time;
+
+    // Mouse position, mouse button index, the new window size, or whether the window has become
+    // fully obscured.
+    i32 x, y;
+} InputEvent;
+
+#define INPUT_QUEUE_CAPACITY 256
+
+typedef struct {
+    InputEvent events[INPUT_QUEUE_CAPACITY];
+    isize volatile head;
+    isize volatile tail;
+} InputQueue;
+
+static bool input_queue_full(InputQueue *queue) {
+    return queue->tail - isize_atomic_load(&queue->head) >= INPUT_QUEUE_CAPACITY;
+}
+
+static void input_queue_push(InputQueue *queue, InputEvent const *event) {
+    isize tail = queue->tail;
+    assert(tail - isize_atomic_load(&queue->head) < INPUT_QUEUE_CAPACITY);
+
+    queue->events[tail % INPUT_QUEUE_CAPACITY] = *event;
+    isize_atomic_store(&queue->tail, tail + 1);
+}
+
+static bool input_queue_pop(InputQueue *queue, InputEvent *event) {
+    isize head = queue->head;
+    if (head == isize_atomic_load(&queue->tail)) {
+        return false;
+    }
+
+    *event = queue->events[head % INPUT_QUEUE_CAPACITY];
+    isize_atomic_store(&queue->head, head + 1);
+
+    return true;
+}
+
 static void gui_bitmap_destroy(Display *display, GuiBitmap *bitmap) {
+#ifdef GUI_RENDER
+    if (bitmap->picture != None) {
+        XRenderFreePicture(display, bitmap->picture);
+
+        bitmap->picture = None;
+    }
+#endif
+
+    if (bitmap->pixmap != None) {
+        XFreePixmap(display, bitmap->pixmap);
+
+        bitmap->pixmap = None;
+    }
+
     if (bitmap->shared_segment.shmaddr != NULL) {
         XShmDetach(display, &bitmap->shared_segment);
         XSync(display, False);
 
-        shmdt(bitmap->shared_segment.shmaddr);
-        shmctl(bitmap->shared_segment.shmid, IPC_RMID, 0);
+        // System V segments have been marked for removal right after getting attached, so they're
+        // gone once detached.
+        if (bitmap->mapped_size != 0) {
+            munmap(bitmap->shared_segment.shmaddr, (size_t)bitmap->mapped_size);
+        } else {
+            shmdt(bitmap->shared_segment.shmaddr);
+        }
 
         bitmap->shared_segment.shmaddr = NULL;
+        bitmap->mapped_size = 0;
     }
 
     if (bitmap->image != NULL) {
@@ -147,53 +353,177 @@ static void gui_bitmap_destroy(Display *display, GuiBitmap *bitmap) {
     }
 }
 
-static bool gui_bitmap_create(
-    Display *display,
-    XVisualInfo *visual_info,
-    isize width,
-    isize height,
-    GuiBitmap *bitmap
-) {
-    XImage *image = XShmCreateImage(
-        display,
-        visual_info->visual,
-        (unsigned int)visual_info->depth,
-        ZPixmap,
-        NULL,
-        &bitmap->shared_segment,
-        (unsigned int)width,
-        (unsigned int)height
-    );
-    if (image == NULL || image->bits_per_pixel != 32) {
-        goto fail;
+// Errors only arrive after a round-trip, and the default handler would terminate the process. The
+// handler is process-wide though, and the presenter and input threads keep using their connections
+// meanwhile, so it only claims the error of the attach request itself and passes everything else on
+// to the handler which was there before. Only the main thread ever attaches segments.
+static struct {
+    Display *display;
+    unsigned long serial;
+    int (*previous_handler)(Display *, XErrorEvent *);
+    isize volatile error_happened;
+} shm_attach;
+
+static int shm_error_handler(Display *display, XErrorEvent *event) {
+    if (display == shm_attach.display && event->serial == shm_attach.serial) {
+        isize_atomic_store(&shm_attach.error_happened, true);
+        return 0;
     }
 
-    isize buffer_size = image->bytes_per_line * image->height;
-    int shmid = shmget(IPC_PRIVATE, (size_t)buffer_size, IPC_CREAT | 0666);
+    if (shm_attach.previous_handler != NULL) {
+        return shm_attach.previous_handler(display, event);
+    }
+    return 0;
+}
+
+// Once the server has attached to a segment, it can be marked for removal: it stays around until
+// everyone detaches from it, so it doesn't outlive the process even if the process gets killed.
+//
+// The server might report the extension and still fail to attach, if it's running on another
+// machine.
+static bool gui_bitmap_attach_segment(Display *display, isize size, GuiBitmap *bitmap) {
+    int shmid = shmget(IPC_PRIVATE, (size_t)size, IPC_CREAT | 0666);
     if (shmid == -1) {
-        goto fail;
+        return false;
     }
 
-    bitmap->available = true;
+    void *address = shmat(shmid, 0, 0);
+    if (address == (void *)-1) {
+        shmctl(shmid, IPC_RMID, 0);
+        return false;
+    }
 
     bitmap->shared_segment.shmid = shmid;
-    bitmap->shared_segment.shmaddr = shmat(shmid, 0, 0);
+    bitmap->shared_segment.shmaddr = address;
     bitmap->shared_segment.readOnly = false;
 
-    image->data = bitmap->shared_segment.shmaddr;
+    shm_attach.display = display;
+    shm_attach.serial = NextRequest(display);
+    isize_atomic_store(&shm_attach.error_happened, false);
+    shm_attach.previous_handler = XSetErrorHandler(shm_error_handler);
+
     XShmAttach(display, &bitmap->shared_segment);
+    XSync(display, False);
+    shmctl(shmid, IPC_RMID, 0);
 
-    bitmap->image = image;
-    bitmap->width = width;
-    bitmap->height = height;
+    XSetErrorHandler(shm_attach.previous_handler);
+    shm_attach.display = NULL;
+
+    if (isize_atomic_load(&shm_attach.error_happened)) {
+        shmdt(address);
+        bitmap->shared_segment.shmaddr = NULL;
+        return false;
+    }
 
     return true;
+}
 
-fail:
-    gui_bitmap_destroy(display, bitmap);
-    return false;
+#ifdef GUI_SHM_FD
+
+// ShmAttachFd request, the file descriptor gets sent along with it. XCB fills in the major opcode
+// and the length.
+typedef struct {
+    u8 major_opcode;
+    u8 minor_opcode;
+    u16 length;
+    u32 shmseg;
+    u8 read_only;
+    u8 pad[3];
+} ShmAttachFdRequest;
+
+#define SHM_ATTACH_FD_OPCODE 6
+
+static xcb_extension_t shm_extension = {"MIT-SHM", 0};
+
+// Unlike with System V segments, there is nothing to clean up after the process, if it dies.
+static bool gui_bitmap_attach_fd(Display *display, isize size, GuiBitmap *bitmap) {
+    int major_version, minor_version;
+    Bool pixmaps_supported;
+    if (!XShmQueryVersion(display, &major_version, &minor_version, &pixmaps_supported)) {
+        return false;
+    }
+    if (major_version < 1 || (major_version == 1 && minor_version < 2)) {
+        return false;
+    }
+
+    // File descriptors can only be passed over a local connection.
+    struct sockaddr_storage socket_address;
+    socklen_t socket_address_size = sizeof(socket_address);
+    int socket_status = getsockname(
+        ConnectionNumber(display),
+        (struct sockaddr *)&socket_address,
+        &socket_address_size
+    );
+    if (socket_status != 0 || socket_address.ss_family != AF_UNIX) {
+        return false;
+    }
+
+    int fd = memfd_create("gui-bitmap", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        return false;
+    }
+
+    // The server would get killed by SIGBUS, if the file got shrunk while it's mapped.
+    if (ftruncate(fd, (off_t)size) != 0) {
+        close(fd);
+        return false;
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+    void *address = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    bitmap->shared_segment.shmid = -1;
+    bitmap->shared_segment.shmaddr = address;
+    bitmap->shared_segment.readOnly = false;
+    bitmap->shared_segment.shmseg = XAllocID(display);
+
+    ShmAttachFdRequest request = {
+        .minor_opcode = SHM_ATTACH_FD_OPCODE,
+        .shmseg = (u32)bitmap->shared_segment.shmseg,
+        .read_only = false,
+    };
+    xcb_protocol_request_t protocol_request = {
+        .count = 1,
+        .ext = &shm_extension,
+        .opcode = SHM_ATTACH_FD_OPCODE,
+        .isvoid = 1,
+    };
+
+    // XCB needs two spare entries in front of the request, and it takes the ownership of the file
+    // descriptor.
+    struct iovec request_parts[3] = {
+        [2] = {.iov_base = &request, .iov_len = sizeof(request)},
+    };
+
+    // A checked request hands its error back to us instead of to the error handler of Xlib.
+    xcb_connection_t *connection = XGetXCBConnection(display);
+    unsigned int sequence = xcb_send_request_with_fds(
+        connection,
+        XCB_REQUEST_CHECKED,
+        &request_parts[2],
+        &protocol_request,
+        1,
+        &fd
+    );
+
+    xcb_generic_error_t *error = xcb_request_check(connection, (xcb_void_cookie_t){sequence});
+    if (error != NULL) {
+        free(error);
+        munmap(address, (size_t)size);
+        bitmap->shared_segment.shmaddr = NULL;
+        return false;
+    }
+
+    bitmap->mapped_size = size;
+    return true;
 }
 
+#endif // GUI_SHM_FD
+
 struct GuiWindow {
     Display *display;
     Window handle;
@@ -207,10 +537,85 @@ struct GuiWindow {
         int shm_completion;
     } event;
 
+    GuiPresentMode present_mode;
+    // Without graphics exposures, so that copying out of pixmaps doesn't produce NoExpose events.
+    GC present_gc;
+
+#ifdef GUI_RENDER
+    // Only in the GUI_PRESENT_RENDER mode. Everything lives on the connection which bitmaps get
+    // submitted through.
+    struct {
+        int scale;
+        XRenderPictFormat *format;
+        Picture window_picture;
+
+        // None until the first gui_window_set_backdrop.
+        Pixmap backdrop;
+        int backdrop_width;
+        int backdrop_height;
+    } render;
+#endif
+
+    // Only in the GUI_PRESENT_EXTENSION mode.
+    struct {
+#ifdef GUI_PRESENT
+        u32 event_id;
+        xcb_special_event_t *events;
+        // Gets set to the damage of the bitmap before every present.
+        u32 update_region;
+#endif
+        // Microseconds since the window has been created, or -1 if nothing has been displayed yet.
+        // Written by the presenter thread.
+        isize volatile display_time;
+    } present;
+
+    // Bitmaps get submitted to the X server and waited for on a separate thread, which has its own
+    // connection, so that the main thread never stalls on a round-trip to the server. The main
+    // thread only touches that connection while the presenter holds no bitmaps.
+    //
+    // If the presenter thread can't be started, bitmaps get submitted from the main thread.
+    struct {
+        bool running;
+        pthread_t thread;
+        Display *display;
+        int shm_completion;
+
+        BitmapQueue submitted;
+        BitmapQueue returned;
+        // Bitmaps which have been submitted, but haven't been taken back from the returned queue.
+        isize in_flight_count;
+    } presenter;
+
+    // Only runs along with the presenter: otherwise the main thread waits for ShmCompletion events
+    // on the main connection itself, and it can't share those with the input thread.
+    struct {
+        bool running;
+        pthread_t thread;
+        // Gets written into to wake up the thread when it has to quit.
+        int wake_up_pipe[2];
+
+        InputQueue queue;
+    } input;
+
     isize width;
     isize height;
     bool resized;
-    GuiBitmap bitmap;
+    // The server has lost some of the window contents, so the next present has to be a full one.
+    bool exposed;
+    // Minimized windows get unmapped by the window manager.
+    bool mapped;
+    bool fully_obscured;
+
+    GuiBitmap bitmaps[GUI_MAX_BITMAP_COUNT];
+    isize bitmap_count;
+    // Gets incremented on every present.
+    isize present_count;
+
+    struct {
+        int request_count;
+        int stall_count;
+    } bitmap_stats;
+
     bool should_close;
 
     int mouse_x;
@@ -222,15 +627,1031 @@ struct GuiWindow {
         bool currently_down;
     } mouse_buttons[2];
 
-    struct {
-        struct timespec created_time;
-        struct timespec last_update_time;
-        f64 last_frame_time;
-    } timer;
+    struct {
+        struct timespec created_time;
+        struct timespec last_update_time;
+        f64 last_frame_time;
+        f64 last_input_time;
+    } timer;
+
+    f64 target_fps;
+    FPSCounter fps_counter;
+};
+
+static f64 gui_window_time_since(struct timespec const *start_time) {
+    struct timespec current_time;
+    clock_gettime(CLOCK_MONOTONIC, &current_time);
+
+    return
+        (f64)(current_time.tv_sec - start_time->tv_sec) +
+        (f64)(current_time.tv_nsec - start_time->tv_nsec) / 1e9;
+}
+
+// Returns false for events which are of no interest. Gets called from the input thread, so it
+// can only read the parts of the window which don't change after creation.
+static bool input_event_translate(
+    GuiWindow const *window,
+    XEvent const *event,
+    InputEvent *input_event
+) {
+    switch (event->type) {
+    case ConfigureNotify: {
+        input_event->type = INPUT_EVENT_RESIZE;
+        input_event->x = event->xconfigure.width;
+        input_event->y = event->xconfigure.height;
+    } break;
+
+    case Expose: {
+        input_event->type = INPUT_EVENT_EXPOSE;
+    } break;
+
+    case MapNotify: {
+        input_event->type = INPUT_EVENT_MAP;
+    } break;
+
+    case UnmapNotify: {
+        input_event->type = INPUT_EVENT_UNMAP;
+    } break;
+
+    case VisibilityNotify: {
+        input_event->type = INPUT_EVENT_VISIBILITY;
+        input_event->x = event->xvisibility.state == VisibilityFullyObscured;
+    } break;
+
+    case ClientMessage: {
+        if ((Atom)event->xclient.data.l[0] != window->atom.delete_window) {
+            return false;
+        }
+        input_event->type = INPUT_EVENT_CLOSE;
+    } break;
+
+    case MotionNotify: {
+        input_event->type = INPUT_EVENT_MOUSE_MOVE;
+        input_event->x = event->xmotion.x;
+        input_event->y = event->xmotion.y;
+    } break;
+
+    case ButtonPress:
+    case ButtonRelease: {
+        if (event->xbutton.button == Button1) {
+            input_event->x = GUI_MOUSE_BUTTON_LEFT;
+        } else if (event->xbutton.button == Button3) {
+            input_event->x = GUI_MOUSE_BUTTON_RIGHT;
+        } else {
+            return false;
+        }
+
+        input_event->type =
+            event->type == ButtonPress ? INPUT_EVENT_BUTTON_PRESS : INPUT_EVENT_BUTTON_RELEASE;
+    } break;
+
+    default: {
+        return false;
+    } break;
+    }
+
+    input_event->time = gui_window_time_since(&window->timer.created_time);
+    return true;
+}
+
+static void input_event_apply(GuiWindow *window, InputEvent const *event) {
+    window->timer.last_input_time = event->time;
+
+    switch (event->type) {
+    case INPUT_EVENT_RESIZE: {
+        if (window->width != event->x || window->height != event->y) {
+            window->width = event->x;
+            window->height = event->y;
+            window->resized = true;
+        }
+    } break;
+
+    case INPUT_EVENT_EXPOSE: {
+        window->exposed = true;
+    } break;
+
+    // Whatever becomes visible again comes with Expose events.
+    case INPUT_EVENT_MAP: {
+        window->mapped = true;
+    } break;
+
+    case INPUT_EVENT_UNMAP: {
+        window->mapped = false;
+    } break;
+
+    case INPUT_EVENT_VISIBILITY: {
+        window->fully_obscured = event->x != 0;
+    } break;
+
+    case INPUT_EVENT_CLOSE: {
+        window->should_close = true;
+    } break;
+
+    case INPUT_EVENT_MOUSE_MOVE: {
+        window->mouse_x = event->x;
+        window->mouse_y = event->y;
+    } break;
+
+    case INPUT_EVENT_BUTTON_PRESS: {
+        window->mouse_buttons[event->x].currently_down = true;
+    } break;
+
+    case INPUT_EVENT_BUTTON_RELEASE: {
+        window->mouse_buttons[event->x].currently_down = false;
+    } break;
+    }
+}
+
+static void gui_window_handle_event(GuiWindow *window, XEvent *event) {
+    if (event->type == window->event.shm_completion) {
+        XShmCompletionEvent const *completion = (XShmCompletionEvent const *)event;
+
+        for (isize i = 0; i < window->bitmap_count; i += 1) {
+            if (window->bitmaps[i].shared_segment.shmseg == completion->shmseg) {
+                window->bitmaps[i].available = true;
+            }
+        }
+    }
+
+    InputEvent input_event;
+    if (input_event_translate(window, event, &input_event)) {
+        input_event_apply(window, &input_event);
+    }
+}
+
+static void *gui_input_procedure(void *param) {
+    GuiWindow *window = param;
+    Display *display = window->display;
+
+    struct pollfd poll_fds[2] = {
+        {.fd = ConnectionNumber(display), .events = POLLIN},
+        {.fd = window->input.wake_up_pipe[0], .events = POLLIN},
+    };
+
+    while (true) {
+        // Xlib might have already read some events into its own queue, so those have to be handled
+        // before going to sleep on the socket.
+        while (XPending(display) > 0) {
+            XEvent event;
+            XNextEvent(display, &event);
+
+            InputEvent input_event;
+            if (!input_event_translate(window, &event, &input_event)) {
+                continue;
+            }
+
+            // Motion events are the only ones which are fine to lose.
+            if (input_queue_full(&window->input.queue)) {
+                if (input_event.type == INPUT_EVENT_MOUSE_MOVE) {
+                    continue;
+                }
+
+                while (input_queue_full(&window->input.queue)) {
+                    nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+                }
+            }
+            input_queue_push(&window->input.queue, &input_event);
+        }
+
+        if (poll(poll_fds, countof(poll_fds), -1) < 0) {
+            continue;
+        }
+        if (poll_fds[1].revents != 0) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static bool gui_input_start(GuiWindow *window) {
+    if (pipe(window->input.wake_up_pipe) != 0) {
+        return false;
+    }
+
+    if (pthread_create(&window->input.thread, NULL, gui_input_procedure, window) != 0) {
+        close(window->input.wake_up_pipe[0]);
+        close(window->input.wake_up_pipe[1]);
+        return false;
+    }
+
+    window->input.running = true;
+    return true;
+}
+
+static void gui_input_stop(GuiWindow *window) {
+    ssize_t written = write(window->input.wake_up_pipe[1], &(char){0}, 1);
+    (void)written;
+
+    pthread_join(window->input.thread, NULL);
+
+    close(window->input.wake_up_pipe[0]);
+    close(window->input.wake_up_pipe[1]);
+}
+
+// Returns once the bitmap can be written into again, unless a ShmCompletion event is on its way:
+// only the last XShmPutImage asks for one, because requests are handled in order, so the server is
+// done with the whole bitmap once it's done with the last part.
+//
+// Copying out of a pixmap produces no events, so that takes a round-trip instead.
+static bool gui_bitmap_put(Display *display, GuiWindow const *window, GuiBitmap const *bitmap) {
+    switch (window->present_mode) {
+    case GUI_PRESENT_SHM_IMAGE: {
+        for (isize i = 0; i < bitmap->damage_count; i += 1) {
+            GuiRect const *rect = &bitmap->damage[i];
+
+            XShmPutImage(
+                display,
+                window->handle,
+                window->present_gc,
+                bitmap->image,
+                rect->x,
+                rect->y,
+                rect->x,
+                rect->y,
+                (unsigned int)rect->width,
+                (unsigned int)rect->height,
+                i == bitmap->damage_count - 1
+            );
+        }
+        XFlush(display);
+
+        return true;
+    } break;
+
+    case GUI_PRESENT_SHM_PIXMAP: {
+        for (isize i = 0; i < bitmap->damage_count && bitmap->pixmap != None; i += 1) {
+            GuiRect const *rect = &bitmap->damage[i];
+
+            XCopyArea(
+                display,
+                bitmap->pixmap,
+                window->handle,
+                window->present_gc,
+                rect->x,
+                rect->y,
+                (unsigned int)rect->width,
+                (unsigned int)rect->height,
+                rect->x,
+                rect->y
+            );
+        }
+        XSync(display, False);
+
+        return false;
+    } break;
+
+    // Pixels get copied into the request buffer right away, so the bitmap can be written into as
+    // soon as this returns. Damaged rectangles get sent in bands of rows, so that every request
+    // fits into the maximum request size. (Xlib would otherwise split them up on its own, by
+    // halving them over and over.)
+    case GUI_PRESENT_PUT_IMAGE: {
+        isize max_request_size = (isize)XExtendedMaxRequestSize(display);
+        if (max_request_size == 0) {
+            max_request_size = (isize)XMaxRequestSize(display);
+        }
+
+        // Both sizes are in 4-byte units. The PutImage header takes 24 bytes, plus 4 more for the
+        // length field of big requests.
+        isize max_data_size = max_request_size * 4 - 28;
+
+        for (isize i = 0; i < bitmap->damage_count; i += 1) {
+            GuiRect const *rect = &bitmap->damage[i];
+
+            isize band_height = max_data_size / (rect->width * 4);
+            band_height = band_height < 1 ? 1 : band_height;
+
+            for (isize band_y = rect->y; band_y < rect->y + rect->height; band_y += band_height) {
+                isize band_end_y = band_y + band_height;
+                if (band_end_y > rect->y + rect->height) {
+                    band_end_y = rect->y + rect->height;
+                }
+
+                XPutImage(
+                    display,
+                    window->handle,
+                    window->present_gc,
+                    bitmap->image,
+                    rect->x,
+                    (int)band_y,
+                    rect->x,
+                    (int)band_y,
+                    (unsigned int)rect->width,
+                    (unsigned int)(band_end_y - band_y)
+                );
+            }
+        }
+        XFlush(display);
+
+        return false;
+    } break;
+
+#ifdef GUI_RENDER
+    // Bitmap pixels get scaled up into window pixels, and the backdrop only gets copied around the
+    // clip rectangle, so that the window never shows the backdrop where the bitmap goes.
+    case GUI_PRESENT_RENDER: {
+        GuiRect const *clip = &bitmap->clip;
+
+        if (bitmap->backdrop_damaged && window->render.backdrop != None) {
+            int width = window->render.backdrop_width;
+            int height = window->render.backdrop_height;
+            int clip_end_x = clip->x + clip->width;
+            int clip_end_y = clip->y + clip->height;
+
+            // Above, below, to the left and to the right of the clip rectangle.
+            GuiRect bands[4] = {
+                {0, 0, width, clip->y},
+                {0, clip_end_y, width, height - clip_end_y},
+                {0, clip->y, clip->x, clip->height},
+                {clip_end_x, clip->y, width - clip_end_x, clip->height},
+            };
+            for (isize i = 0; i < countof(bands); i += 1) {
+                if (bands[i].width <= 0 || bands[i].height <= 0) {
+                    continue;
+                }
+
+                XCopyArea(
+                    display,
+                    window->render.backdrop,
+                    window->handle,
+                    window->present_gc,
+                    bands[i].x,
+                    bands[i].y,
+                    (unsigned int)bands[i].width,
+                    (unsigned int)bands[i].height,
+                    bands[i].x,
+                    bands[i].y
+                );
+            }
+        }
+
+        int scale = window->render.scale;
+        for (isize i = 0; i < bitmap->damage_count && bitmap->picture != None; i += 1) {
+            GuiRect const *rect = &bitmap->damage[i];
+
+            int from_x = bitmap->x + rect->x * scale;
+            int from_y = bitmap->y + rect->y * scale;
+            int to_x = from_x + rect->width * scale;
+            int to_y = from_y + rect->height * scale;
+
+            from_x = from_x < clip->x ? clip->x : from_x;
+            from_y = from_y < clip->y ? clip->y : from_y;
+            to_x = to_x > clip->x + clip->width ? clip->x + clip->width : to_x;
+            to_y = to_y > clip->y + clip->height ? clip->y + clip->height : to_y;
+            if (from_x >= to_x || from_y >= to_y) {
+                continue;
+            }
+
+            // Source coordinates go through the transform, so they are in window pixels too.
+            XRenderComposite(
+                display,
+                PictOpSrc,
+                bitmap->picture,
+                None,
+                window->render.window_picture,
+                from_x - bitmap->x,
+                from_y - bitmap->y,
+                0,
+                0,
+                from_x,
+                from_y,
+                (unsigned int)(to_x - from_x),
+                (unsigned int)(to_y - from_y)
+            );
+        }
+        XSync(display, False);
+
+        return false;
+    } break;
+#endif
+
+    default: {
+        assert(false);
+        return false;
+    } break;
+    }
+}
+
+#ifdef GUI_RENDER
+
+// Window pixels map onto bitmap pixels through the transform, and each of them takes the bitmap
+// pixel it falls into. Dividing through the homogeneous coordinate keeps the mapping exact.
+static void gui_bitmap_create_picture(Display *display, GuiBitmap *bitmap) {
+    GuiWindow const *window = bitmap->window;
+
+    bitmap->picture = XRenderCreatePicture(
+        display,
+        bitmap->pixmap,
+        window->render.format,
+        0,
+        NULL
+    );
+
+    XTransform transform = {{
+        {XDoubleToFixed(1.0), XDoubleToFixed(0.0), XDoubleToFixed(0.0)},
+        {XDoubleToFixed(0.0), XDoubleToFixed(1.0), XDoubleToFixed(0.0)},
+        {XDoubleToFixed(0.0), XDoubleToFixed(0.0), XDoubleToFixed(window->render.scale)},
+    }};
+    XRenderSetPictureTransform(display, bitmap->picture, &transform);
+    XRenderSetPictureFilter(display, bitmap->picture, FilterNearest, NULL, 0);
+}
+
+#endif
+
+// Has to be called again whenever the image changes its size. Pixmaps can't be empty, so there is
+// none for an empty bitmap.
+static void gui_bitmap_create_pixmap(Display *display, GuiBitmap *bitmap) {
+    GuiWindow const *window = bitmap->window;
+
+    GuiPresentMode mode = window->present_mode;
+    if (
+        mode != GUI_PRESENT_SHM_PIXMAP &&
+        mode != GUI_PRESENT_EXTENSION &&
+        mode != GUI_PRESENT_RENDER
+    ) {
+        return;
+    }
+    if (bitmap->width == 0 || bitmap->height == 0) {
+        return;
+    }
+
+    bitmap->pixmap = XShmCreatePixmap(
+        display,
+        window->handle,
+        bitmap->shared_segment.shmaddr,
+        &bitmap->shared_segment,
+        (unsigned int)bitmap->width,
+        (unsigned int)bitmap->height,
+        (unsigned int)window->visual_info.depth
+    );
+
+#ifdef GUI_RENDER
+    if (mode == GUI_PRESENT_RENDER) {
+        gui_bitmap_create_picture(display, bitmap);
+    }
+#endif
+}
+
+// The image comes without the pixel memory.
+static XImage *gui_bitmap_create_image(
+    Display *display,
+    GuiBitmap *bitmap,
+    isize width,
+    isize height
+) {
+    GuiWindow const *window = bitmap->window;
+
+    if (window->present_mode == GUI_PRESENT_PUT_IMAGE) {
+        return XCreateImage(
+            display,
+            window->visual_info.visual,
+            (unsigned int)window->visual_info.depth,
+            ZPixmap,
+            0,
+            NULL,
+            (unsigned int)width,
+            (unsigned int)height,
+            32,
+            0
+        );
+    } else {
+        return XShmCreateImage(
+            display,
+            window->visual_info.visual,
+            (unsigned int)window->visual_info.depth,
+            ZPixmap,
+            NULL,
+            &bitmap->shared_segment,
+            (unsigned int)width,
+            (unsigned int)height
+        );
+    }
+}
+
+static bool gui_bitmap_create(
+    Display *display,
+    GuiWindow *window,
+    isize width,
+    isize height,
+    GuiBitmap *bitmap
+) {
+    bitmap->window = window;
+
+    XImage *image = gui_bitmap_create_image(display, bitmap, width, height);
+    if (image == NULL) {
+        goto fail;
+    }
+    bitmap->image = image;
+    if (image->bits_per_pixel != 32) {
+        goto fail;
+    }
+
+    isize buffer_size = image->bytes_per_line * image->height;
+
+    if (window->present_mode == GUI_PRESENT_PUT_IMAGE) {
+        // Gets freed along with the image.
+        if (buffer_size > 0) {
+            image->data = malloc((size_t)buffer_size);
+            if (image->data == NULL) {
+                goto fail;
+            }
+        }
+    } else {
+        bool attached = false;
+#ifdef GUI_SHM_FD
+        attached = gui_bitmap_attach_fd(display, buffer_size, bitmap);
+#endif
+        if (!attached && !gui_bitmap_attach_segment(display, buffer_size, bitmap)) {
+            goto fail;
+        }
+
+        image->data = bitmap->shared_segment.shmaddr;
+    }
+
+    bitmap->available = true;
+    bitmap->width = width;
+    bitmap->height = height;
+
+    gui_bitmap_create_pixmap(display, bitmap);
+
+    return true;
+
+fail:
+    gui_bitmap_destroy(display, bitmap);
+    return false;
+}
+
+// The connection which bitmaps are attached to and submitted through.
+static Display *gui_window_bitmap_display(GuiWindow const *window) {
+    return window->presenter.running ? window->presenter.display : window->display;
+}
+
+#ifdef GUI_PRESENT
+
+// Requests and events of the Present and XFixes extensions. XCB fills in the major opcode and the
+// length of requests.
+typedef struct {
+    u8 major_opcode;
+    u8 minor_opcode;
+    u16 length;
+    u32 major_version;
+    u32 minor_version;
+} QueryVersionRequest;
+
+typedef struct {
+    u8 response_type;
+    u8 pad;
+    u16 sequence;
+    u32 length;
+    u32 major_version;
+    u32 minor_version;
+} QueryVersionReply;
+
+// Followed by the rectangles of the region.
+typedef struct {
+    u8 major_opcode;
+    u8 minor_opcode;
+    u16 length;
+    u32 region;
+} RegionRequest;
+
+typedef struct {
+    u8 major_opcode;
+    u8 minor_opcode;
+    u16 length;
+    u32 event_id;
+    u32 window;
+    u32 event_mask;
+} PresentSelectInputRequest;
+
+// Followed by the list of windows to notify, which is always empty here.
+typedef struct {
+    u8 major_opcode;
+    u8 minor_opcode;
+    u16 length;
+    u32 window;
+    u32 pixmap;
+    u32 serial;
+    u32 valid_region;
+    u32 update_region;
+    i16 x_offset;
+    i16 y_offset;
+    u32 target_crtc;
+    u32 wait_fence;
+    u32 idle_fence;
+    u32 options;
+    u32 pad;
+    u64 target_msc;
+    u64 divisor;
+    u64 remainder;
+} PresentPixmapRequest;
+
+// Present events are generic events. Only the first 32 bytes are laid out the same way as on the
+// wire, XCB inserts the full sequence number after them.
+typedef struct {
+    u8 response_type;
+    u8 extension;
+    u16 sequence;
+    u32 length;
+    u16 event_type;
+    u8 kind;
+    u8 mode;
+    u32 event_id;
+    u32 window;
+    u32 serial;
+    // Microseconds of CLOCK_MONOTONIC at which the frame has shown up on the screen.
+    u64 ust;
+} PresentCompleteNotify;
+
+typedef struct {
+    u8 response_type;
+    u8 extension;
+    u16 sequence;
+    u32 length;
+    u16 event_type;
+    u16 pad;
+    u32 event_id;
+    u32 window;
+    u32 serial;
+    u32 pixmap;
+    u32 idle_fence;
+} PresentIdleNotify;
+
+#define PRESENT_QUERY_VERSION_OPCODE 0
+#define PRESENT_PIXMAP_OPCODE 1
+#define PRESENT_SELECT_INPUT_OPCODE 3
+
+#define PRESENT_COMPLETE_NOTIFY 1
+#define PRESENT_IDLE_NOTIFY 2
+#define PRESENT_COMPLETE_NOTIFY_MASK 2
+#define PRESENT_IDLE_NOTIFY_MASK 4
+
+#define PRESENT_COMPLETE_KIND_PIXMAP 0
+#define PRESENT_COMPLETE_MODE_SKIP 2
+
+#define XFIXES_QUERY_VERSION_OPCODE 0
+#define XFIXES_CREATE_REGION_OPCODE 5
+#define XFIXES_DESTROY_REGION_OPCODE 10
+#define XFIXES_SET_REGION_OPCODE 11
+
+static xcb_extension_t present_extension = {"Present", 0};
+static xcb_extension_t xfixes_extension = {"XFIXES", 0};
+
+// Extensions want to know which version the client speaks before anything else gets requested.
+static bool xcb_extension_init(
+    xcb_connection_t *connection,
+    xcb_extension_t *extension,
+    u32 major_version,
+    u32 minor_version
+) {
+    xcb_query_extension_reply_t const *extension_data =
+        xcb_get_extension_data(connection, extension);
+    if (extension_data == NULL || !extension_data->present) {
+        return false;
+    }
+
+    QueryVersionRequest request = {
+        .major_version = major_version,
+        .minor_version = minor_version,
+    };
+    xcb_protocol_request_t protocol_request = {
+        .count = 1,
+        .ext = extension,
+        .opcode = 0,
+        .isvoid = 0,
+    };
+    struct iovec request_parts[3] = {
+        [2] = {.iov_base = &request, .iov_len = sizeof(request)},
+    };
+
+    unsigned int sequence = xcb_send_request(
+        connection,
+        XCB_REQUEST_CHECKED,
+        &request_parts[2],
+        &protocol_request
+    );
+
+    xcb_generic_error_t *error = NULL;
+    QueryVersionReply *reply = xcb_wait_for_reply(connection, sequence, &error);
+    free(error);
+    if (reply == NULL) {
+        return false;
+    }
+
+    // The server replies with the highest version which both sides support.
+    bool supported =
+        reply->major_version > major_version ||
+        (reply->major_version == major_version && reply->minor_version >= minor_version);
+    free(reply);
+
+    return supported;
+}
+
+static void xfixes_region_request(
+    xcb_connection_t *connection,
+    u8 opcode,
+    u32 region,
+    GuiRect const *rects,
+    isize rect_count
+) {
+    // Rectangles go over the wire as 16-bit integers.
+    xcb_rectangle_t wire_rects[GUI_BITMAP_MAX_DAMAGE_COUNT];
+    assert(rect_count <= GUI_BITMAP_MAX_DAMAGE_COUNT);
+
+    for (isize i = 0; i < rect_count; i += 1) {
+        wire_rects[i] = (xcb_rectangle_t){
+            .x = (i16)rects[i].x,
+            .y = (i16)rects[i].y,
+            .width = (u16)rects[i].width,
+            .height = (u16)rects[i].height,
+        };
+    }
+
+    RegionRequest request = {.region = region};
+    xcb_protocol_request_t protocol_request = {
+        .count = 2,
+        .ext = &xfixes_extension,
+        .opcode = opcode,
+        .isvoid = 1,
+    };
+    struct iovec request_parts[4] = {
+        [2] = {.iov_base = &request, .iov_len = sizeof(request)},
+        [3] = {.iov_base = wire_rects, .iov_len = (size_t)rect_count * sizeof(xcb_rectangle_t)},
+    };
+
+    xcb_send_request(connection, 0, &request_parts[2], &protocol_request);
+}
+
+// Takes the presenter connection. Frames only get presented from the presenter thread, because
+// waiting for them to show up on the screen can take a whole refresh cycle.
+static bool gui_present_init(Display *display, GuiWindow *window) {
+    xcb_connection_t *connection = XGetXCBConnection(display);
+
+    // Regions are there since XFixes 2.0.
+    if (!xcb_extension_init(connection, &present_extension, 1, 0)) {
+        return false;
+    }
+    if (!xcb_extension_init(connection, &xfixes_extension, 2, 0)) {
+        return false;
+    }
+
+    window->present.update_region = (u32)XAllocID(display);
+    xfixes_region_request(
+        connection,
+        XFIXES_CREATE_REGION_OPCODE,
+        window->present.update_region,
+        NULL,
+        0
+    );
+
+    // Events get delivered into a queue of their own, so that they don't have to go through Xlib.
+    window->present.event_id = (u32)XAllocID(display);
+    window->present.events = xcb_register_for_special_xge(
+        connection,
+        &present_extension,
+        window->present.event_id,
+        NULL
+    );
+
+    PresentSelectInputRequest request = {
+        .event_id = window->present.event_id,
+        .window = (u32)window->handle,
+        .event_mask = PRESENT_COMPLETE_NOTIFY_MASK | PRESENT_IDLE_NOTIFY_MASK,
+    };
+    xcb_protocol_request_t protocol_request = {
+        .count = 1,
+        .ext = &present_extension,
+        .opcode = PRESENT_SELECT_INPUT_OPCODE,
+        .isvoid = 1,
+    };
+    struct iovec request_parts[3] = {
+        [2] = {.iov_base = &request, .iov_len = sizeof(request)},
+    };
+    xcb_send_request(connection, 0, &request_parts[2], &protocol_request);
+
+    xcb_flush(connection);
+    return true;
+}
+
+static void gui_present_destroy(Display *display, GuiWindow *window) {
+    xcb_connection_t *connection = XGetXCBConnection(display);
+
+    xcb_unregister_for_special_event(connection, window->present.events);
+    xfixes_region_request(
+        connection,
+        XFIXES_DESTROY_REGION_OPCODE,
+        window->present.update_region,
+        NULL,
+        0
+    );
+    xcb_flush(connection);
+}
+
+// Presents the pixmap on the next vertical blank, so that there is no tearing, and waits until it
+// has shown up on the screen. The server might keep scanning out of the pixmap until the next one
+// gets presented, so bitmaps only get returned once the server says it's done with them, which
+// is also why this mode takes at least two bitmaps.
+static void gui_present_pixmap(Display *display, GuiWindow *window, GuiBitmap *bitmap) {
+    xcb_connection_t *connection = XGetXCBConnection(display);
+
+    xfixes_region_request(
+        connection,
+        XFIXES_SET_REGION_OPCODE,
+        window->present.update_region,
+        bitmap->damage,
+        bitmap->damage_count
+    );
+
+    u32 serial = (u32)bitmap->present_index;
+
+    PresentPixmapRequest request = {
+        .window = (u32)window->handle,
+        .pixmap = (u32)bitmap->pixmap,
+        .serial = serial,
+        .update_region = window->present.update_region,
+    };
+    xcb_protocol_request_t protocol_request = {
+        .count = 1,
+        .ext = &present_extension,
+        .opcode = PRESENT_PIXMAP_OPCODE,
+        .isvoid = 1,
+    };
+    struct iovec request_parts[3] = {
+        [2] = {.iov_base = &request, .iov_len = sizeof(request)},
+    };
+
+    bitmap->held_by_server = true;
+    xcb_send_request(connection, 0, &request_parts[2], &protocol_request);
+    xcb_flush(connection);
+
+    // Once the frame is on the screen, whatever has been shown before is going to be given back
+    // soon, if it hasn't been already. It's only the latest bitmap which might be held for longer.
+    bool complete = false;
+    while (true) {
+        if (complete) {
+            bool others_held = false;
+            for (isize i = 0; i < window->bitmap_count; i += 1) {
+                if (&window->bitmaps[i] != bitmap && window->bitmaps[i].held_by_server) {
+                    others_held = true;
+                }
+            }
+            if (!others_held) {
+                break;
+            }
+        }
+
+        xcb_generic_event_t *event = xcb_wait_for_special_event(connection, window->present.events);
+        if (event == NULL) {
+            // The connection is broken, nothing is going to be given back.
+            break;
+        }
+
+        // Both kinds of events start the same way.
+        switch (((PresentIdleNotify *)event)->event_type) {
+        case PRESENT_COMPLETE_NOTIFY: {
+            PresentCompleteNotify const *notify = (PresentCompleteNotify const *)event;
+            if (notify->kind != PRESENT_COMPLETE_KIND_PIXMAP || notify->serial != serial) {
+                break;
+            }
+
+            complete = true;
+
+            if (notify->mode != PRESENT_COMPLETE_MODE_SKIP) {
+                struct timespec const *created_time = &window->timer.created_time;
+                isize created_micros =
+                    (isize)created_time->tv_sec * 1000000 + created_time->tv_nsec / 1000;
+
+                isize display_time = (isize)notify->ust - created_micros;
+                isize_atomic_store(&window->present.display_time, display_time);
+            }
+        } break;
+
+        case PRESENT_IDLE_NOTIFY: {
+            PresentIdleNotify const *notify = (PresentIdleNotify const *)event;
+
+            for (isize i = 0; i < window->bitmap_count; i += 1) {
+                GuiBitmap *idle_bitmap = &window->bitmaps[i];
+                if (idle_bitmap->held_by_server && idle_bitmap->pixmap == notify->pixmap) {
+                    idle_bitmap->held_by_server = false;
+                    bitmap_queue_push(&window->presenter.returned, idle_bitmap);
+                }
+            }
+        } break;
+        }
+
+        free(event);
+    }
+
+    if (!complete) {
+        for (isize i = 0; i < window->bitmap_count; i += 1) {
+            GuiBitmap *held_bitmap = &window->bitmaps[i];
+            if (held_bitmap->held_by_server) {
+                held_bitmap->held_by_server = false;
+                bitmap_queue_push(&window->presenter.returned, held_bitmap);
+            }
+        }
+    }
+}
+
+#endif // GUI_PRESENT
+
+static void *gui_presenter_procedure(void *param) {
+    GuiWindow *window = param;
+    Display *display = window->presenter.display;
+
+    while (true) {
+        // NULL means that the window is getting destroyed.
+        GuiBitmap *bitmap = bitmap_queue_pop(&window->presenter.submitted);
+        if (bitmap == NULL) {
+            break;
+        }
+
+#ifdef GUI_PRESENT
+        if (window->present_mode == GUI_PRESENT_EXTENSION) {
+            gui_present_pixmap(display, window, bitmap);
+            continue;
+        }
+#endif
+
+        // The bitmap can't be written into until the server is done reading from it. Nothing else
+        // is selected on this connection, so there are no other events to handle.
+        if (gui_bitmap_put(display, window, bitmap)) {
+            XEvent event;
+            do {
+                XNextEvent(display, &event);
+            } while (event.type != window->presenter.shm_completion);
+        }
+
+        bitmap_queue_push(&window->presenter.returned, bitmap);
+    }
+
+    // Whatever is left on the screen doesn't have to be given back by the server: the pixmaps are
+    // about to be freed anyway, and the server keeps them alive for as long as it needs them.
+    for (isize i = 0; i < window->bitmap_count; i += 1) {
+        GuiBitmap *bitmap = &window->bitmaps[i];
+        if (bitmap->held_by_server) {
+            bitmap->held_by_server = false;
+            bitmap_queue_push(&window->presenter.returned, bitmap);
+        }
+    }
+
+    return NULL;
+}
+
+static bool gui_presenter_start(GuiWindow *window) {
+    window->presenter.display = XOpenDisplay(NULL);
+    if (window->presenter.display == NULL) {
+        goto fail;
+    }
+    window->presenter.shm_completion =
+        XShmGetEventBase(window->presenter.display) + ShmCompletion;
+
+    if (!bitmap_queue_init(&window->presenter.submitted)) {
+        goto fail;
+    }
+    if (!bitmap_queue_init(&window->presenter.returned)) {
+        sem_destroy(&window->presenter.submitted.count);
+        goto fail;
+    }
+
+    if (pthread_create(&window->presenter.thread, NULL, gui_presenter_procedure, window) != 0) {
+        sem_destroy(&window->presenter.returned.count);
+        sem_destroy(&window->presenter.submitted.count);
+        goto fail;
+    }
+
+    window->presenter.running = true;
+    return true;
+
+fail:
+    if (window->presenter.display != NULL) {
+        XCloseDisplay(window->presenter.display);
+        window->presenter.display = NULL;
+    }
+
+    return false;
+}
+
+// Takes back all of the bitmaps in flight, waiting for the presenter where it has to.
+static void gui_presenter_drain(GuiWindow *window) {
+    while (window->presenter.in_flight_count > 0) {
+        GuiBitmap *bitmap = bitmap_queue_pop(&window->presenter.returned);
+        bitmap->available = true;
+        window->presenter.in_flight_count -= 1;
+    }
+}
 
-    f64 target_fps;
-    FPSCounter fps_counter;
-};
+// Stops the thread once it's done with everything submitted so far, and takes back the bitmaps
+// which are still in flight.
+static void gui_presenter_stop(GuiWindow *window) {
+    bitmap_queue_push(&window->presenter.submitted, NULL);
+    pthread_join(window->presenter.thread, NULL);
+
+    gui_presenter_drain(window);
+
+    sem_destroy(&window->presenter.returned.count);
+    sem_destroy(&window->presenter.submitted.count);
+}
 
 GuiWindow *gui_window_create(int width, int height, char const *title, void *arena) {
     assert(width < GUI_MAX_WINDOW_WIDTH && height < GUI_MAX_WINDOW_HEIGHT);
@@ -242,6 +1663,10 @@ GuiWindow *gui_window_create(int width, int height, char const *title, void *are
     window->should_close = false;
     window->resized = false;
 
+    // Connections get used from both the main thread and the presenter thread. This has to be the
+    // first Xlib call.
+    bool threads_initialized = XInitThreads() != 0;
+
     // Open a connection to X server.
     {
         Display *display = XOpenDisplay(NULL);
@@ -290,7 +1715,7 @@ GuiWindow *gui_window_create(int width, int height, char const *title, void *are
             .colormap = colormap,
             .bit_gravity = StaticGravity,
             .event_mask =
-                StructureNotifyMask |
+                StructureNotifyMask | ExposureMask | VisibilityChangeMask |
                 ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
         };
         Window handle = XCreateWindow(
@@ -325,9 +1750,76 @@ GuiWindow *gui_window_create(int width, int height, char const *title, void *are
         XSetWMProtocols(window->display, window->handle, &window->atom.delete_window, 1);
     }
 
-    // Create a bitmap.
-    gui_bitmap_create(window->display, &window->visual_info, width, height, &window->bitmap);
-    window->bitmap.window = window;
+    // Bitmaps have to be attached to the connection they get submitted through, so start the
+    // presenter first. It's fine if it doesn't start.
+    if (threads_initialized) {
+        gui_presenter_start(window);
+    }
+
+    // Pick the present mode. Server-side pixmaps save the server from copying the pixels over on
+    // every present, but only if it can read them from the shared memory directly. Without shared
+    // memory (say, over SSH X forwarding) pixels have to be sent over the connection.
+    {
+        Display *display = gui_window_bitmap_display(window);
+
+        int major_version, minor_version;
+        Bool pixmaps_supported = False;
+        if (!XShmQueryVersion(display, &major_version, &minor_version, &pixmaps_supported)) {
+            window->present_mode = GUI_PRESENT_PUT_IMAGE;
+        } else if (pixmaps_supported && XShmPixmapFormat(display) == ZPixmap) {
+            window->present_mode = GUI_PRESENT_SHM_PIXMAP;
+        } else {
+            window->present_mode = GUI_PRESENT_SHM_IMAGE;
+        }
+
+        window->present_gc = XCreateGC(
+            display,
+            window->handle,
+            GCGraphicsExposures,
+            &(XGCValues){.graphics_exposures = False}
+        );
+    }
+
+    // Create the bitmaps. It's fine to end up with fewer of them, as long as there is at least one.
+    // The server might not be able to attach to shared memory even though it has the extension, in
+    // which case pixels have to be sent over the connection after all.
+    while (true) {
+        for (isize i = 0; i < GUI_MAX_BITMAP_COUNT; i += 1) {
+            bool bitmap_created = gui_bitmap_create(
+                gui_window_bitmap_display(window),
+                window,
+                width, height,
+                &window->bitmaps[i]
+            );
+            if (!bitmap_created) {
+                break;
+            }
+
+            window->bitmap_count = i + 1;
+        }
+
+        if (window->bitmap_count > 0 || window->present_mode == GUI_PRESENT_PUT_IMAGE) {
+            break;
+        }
+        window->present_mode = GUI_PRESENT_PUT_IMAGE;
+    }
+    if (window->bitmap_count == 0) {
+        goto fail;
+    }
+
+    // The Present extension tells when frames actually show up on the screen, and lets the server
+    // flip pixmaps onto the screen instead of copying them. It's fine if it isn't there.
+    window->present.display_time = -1;
+#ifdef GUI_PRESENT
+    if (
+        window->present_mode == GUI_PRESENT_SHM_PIXMAP &&
+        window->presenter.running &&
+        window->bitmap_count >= 2 &&
+        gui_present_init(window->presenter.display, window)
+    ) {
+        window->present_mode = GUI_PRESENT_EXTENSION;
+    }
+#endif
 
     // Show the window only once everything is initialized.
     XMapWindow(window->display, window->handle);
@@ -342,10 +1834,31 @@ GuiWindow *gui_window_create(int width, int height, char const *title, void *are
 
     fps_counter_init(&window->fps_counter);
 
+    // Reads the created time, so has to start after the timer.
+    if (window->presenter.running) {
+        gui_input_start(window);
+    }
+
     return window;
 
 fail:
-    gui_bitmap_destroy(window->display, &window->bitmap);
+    if (window->presenter.running) {
+        gui_presenter_stop(window);
+        for (isize i = 0; i < window->bitmap_count; i += 1) {
+            gui_bitmap_destroy(window->presenter.display, &window->bitmaps[i]);
+        }
+        if (window->present_gc != NULL) {
+            XFreeGC(window->presenter.display, window->present_gc);
+        }
+        XCloseDisplay(window->presenter.display);
+    } else {
+        for (isize i = 0; i < window->bitmap_count; i += 1) {
+            gui_bitmap_destroy(window->display, &window->bitmaps[i]);
+        }
+        if (window->present_gc != NULL) {
+            XFreeGC(window->display, window->present_gc);
+        }
+    }
 
     if (window->handle != None) {
         XDestroyWindow(window->display, window->handle);
@@ -358,56 +1871,14 @@ fail:
     return NULL;
 }
 
-static void gui_window_handle_event(GuiWindow *window, XEvent *event) {
-    if (event->type == window->event.shm_completion) {
-        window->bitmap.available = true;
-    }
-
-    switch (event->type) {
-    case ConfigureNotify: {
-        if (
-            window->width != event->xconfigure.width ||
-            window->height != event->xconfigure.height
-        ) {
-            window->width = event->xconfigure.width;
-            window->height = event->xconfigure.height;
-            window->resized = true;
-        }
-    } break;
-
-    case ClientMessage: {
-        if ((Atom)event->xclient.data.l[0] == window->atom.delete_window) {
-            window->should_close = true;
-        }
-    } break;
-
-    case MotionNotify: {
-        window->mouse_x = event->xmotion.x;
-        window->mouse_y = event->xmotion.y;
-    } break;
-
-    case ButtonPress: {
-        if (event->xbutton.button == Button1) {
-            window->mouse_buttons[GUI_MOUSE_BUTTON_LEFT].currently_down = true;
-        } else if (event->xbutton.button == Button3) {
-            window->mouse_buttons[GUI_MOUSE_BUTTON_RIGHT].currently_down = true;
-        }
-    } break;
-
-    case ButtonRelease: {
-        if (event->xbutton.button == Button1) {
-            window->mouse_buttons[GUI_MOUSE_BUTTON_LEFT].currently_down = false;
-        } else if (event->xbutton.button == Button3) {
-            window->mouse_buttons[GUI_MOUSE_BUTTON_RIGHT].currently_down = false;
-        }
-    } break;
-    }
-}
-
 bool gui_window_resized(GuiWindow const *window) {
     return window->resized;
 }
 
+bool gui_window_visible(GuiWindow const *window) {
+    return window->mapped && !window->fully_obscured;
+}
+
 void gui_mouse_position(GuiWindow const *window, int *mouse_x, int *mouse_y) {
     *mouse_x = window->mouse_x;
     *mouse_y = window->mouse_y;
@@ -479,32 +1950,94 @@ bool gui_window_should_close(GuiWindow *window) {
         window->mouse_buttons[i].is_down = window->mouse_buttons[i].currently_down;
     }
 
-    while (!window->should_close && XPending(window->display) > 0) {
-        XEvent event;
-        XNextEvent(window->display, &event);
-        gui_window_handle_event(window, &event);
+    if (window->input.running) {
+        InputEvent event;
+        while (!window->should_close && input_queue_pop(&window->input.queue, &event)) {
+            input_event_apply(window, &event);
+        }
+    } else {
+        while (!window->should_close && XPending(window->display) > 0) {
+            XEvent event;
+            XNextEvent(window->display, &event);
+            gui_window_handle_event(window, &event);
+        }
     }
 
     return window->should_close;
 }
 
+// Picks the available bitmap which has been presented most recently, because it needs the least to
+// be rendered anew. Returns NULL if all of the bitmaps are busy.
+static GuiBitmap *gui_window_latest_bitmap(GuiWindow *window) {
+    GuiBitmap *latest_bitmap = NULL;
+
+    for (isize i = 0; i < window->bitmap_count; i += 1) {
+        GuiBitmap *bitmap = &window->bitmaps[i];
+        if (!bitmap->available) {
+            continue;
+        }
+
+        if (latest_bitmap == NULL || bitmap->present_index > latest_bitmap->present_index) {
+            latest_bitmap = bitmap;
+        }
+    }
+
+    return latest_bitmap;
+}
+
 GuiBitmap *gui_window_bitmap(GuiWindow *window) {
-    if (!window->bitmap.available) {
+    window->bitmap_stats.request_count += 1;
+
+    // Take back whatever the presenter is done with. (Without the presenter, completion events get
+    // handled along with the rest of the events.)
+    if (window->presenter.running) {
+        while (window->presenter.in_flight_count > 0) {
+            GuiBitmap *bitmap = bitmap_queue_try_pop(&window->presenter.returned);
+            if (bitmap == NULL) {
+                break;
+            }
+
+            bitmap->available = true;
+            window->presenter.in_flight_count -= 1;
+        }
+    }
+
+    GuiBitmap *bitmap = gui_window_latest_bitmap(window);
+    if (bitmap != NULL) {
+        return bitmap;
+    }
+
+    window->bitmap_stats.stall_count += 1;
+
+    if (window->presenter.running) {
+        assert(window->presenter.in_flight_count > 0);
+
+        bitmap = bitmap_queue_pop(&window->presenter.returned);
+        bitmap->available = true;
+        window->presenter.in_flight_count -= 1;
+    } else {
         // Block at least until the next event, so that we don't busy-loop.
         do {
             XEvent event;
             XNextEvent(window->display, &event);
             gui_window_handle_event(window, &event);
-        } while(!window->bitmap.available);
+
+            bitmap = gui_window_latest_bitmap(window);
+        } while (bitmap == NULL);
     }
 
-    return &window->bitmap;
+    return bitmap;
+}
+
+void gui_window_bitmap_stats(GuiWindow const *window, int *request_count, int *stall_count) {
+    *request_count = window->bitmap_stats.request_count;
+    *stall_count = window->bitmap_stats.stall_count;
 }
 
 uint32_t *gui_bitmap_data(GuiBitmap const *bitmap) {
     assert(bitmap->available);
 
-    return (u32 *)bitmap->shared_segment.shmaddr;
+    return (u32 *)bitmap->image->data;
 }
 
 void gui_bitmap_size(GuiBitmap const *bitmap, int *width, int *height) {
@@ -519,73 +2052,278 @@ bool gui_bitmap_resize(GuiBitmap *bitmap, int width, int height) {
     isize buffer_new_size = width * height * 4;
 
     GuiWindow *window = bitmap->window;
+    Display *display = gui_window_bitmap_display(window);
 
     if (buffer_old_size >= buffer_new_size) {
-        XImage *new_image = XShmCreateImage(
-            window->display,
-            window->visual_info.visual,
-            (unsigned int)window->visual_info.depth,
-            ZPixmap,
-            NULL,
-            &bitmap->shared_segment,
-            (unsigned int)width,
-            (unsigned int)height
-        );
+        XImage *new_image = gui_bitmap_create_image(display, bitmap, width, height);
         if (new_image == NULL || new_image->bits_per_pixel != 32) {
             return false;
         }
 
+        // The memory moves over to the new image.
+        char *data = bitmap->image->data;
+        bitmap->image->data = NULL;
         XDestroyImage(bitmap->image);
 
-        new_image->data = bitmap->shared_segment.shmaddr;
+        new_image->data = data;
         bitmap->image = new_image;
         bitmap->width = width;
         bitmap->height = height;
 
+#ifdef GUI_RENDER
+        if (bitmap->picture != None) {
+            XRenderFreePicture(display, bitmap->picture);
+            bitmap->picture = None;
+        }
+#endif
+        if (bitmap->pixmap != None) {
+            XFreePixmap(display, bitmap->pixmap);
+            bitmap->pixmap = None;
+        }
+        gui_bitmap_create_pixmap(display, bitmap);
+
         return true;
     } else {
-        gui_bitmap_destroy(window->display, bitmap);
+        gui_bitmap_destroy(display, bitmap);
         memset(bitmap, 0, (size_t)sizeof(GuiBitmap));
 
-        if (!gui_bitmap_create(window->display, &window->visual_info, width, height, bitmap)) {
+        if (!gui_bitmap_create(display, window, width, height, bitmap)) {
             bitmap->width = 0;
             bitmap->height = 0;
             return false;
         }
-        bitmap->window = window;
 
         return true;
     }
 }
 
-void gui_bitmap_render(GuiBitmap *bitmap) {
+static void gui_bitmap_submit(GuiBitmap *bitmap, GuiRect const *damage, int damage_count) {
     assert(bitmap->available);
 
+    GuiWindow *window = bitmap->window;
+    bitmap->backdrop_damaged = window->exposed;
+    if (window->exposed) {
+        window->exposed = false;
+        damage = NULL;
+    }
+
+    if (damage == NULL) {
+        bitmap->damage[0] = (GuiRect){0, 0, bitmap->width, bitmap->height};
+        bitmap->damage_count = 1;
+    } else if (damage_count > GUI_BITMAP_MAX_DAMAGE_COUNT) {
+        int min_x = damage[0].x;
+        int min_y = damage[0].y;
+        int max_x = damage[0].x + damage[0].width;
+        int max_y = damage[0].y + damage[0].height;
+        for (isize i = 1; i < damage_count; i += 1) {
+            min_x = damage[i].x < min_x ? damage[i].x : min_x;
+            min_y = damage[i].y < min_y ? damage[i].y : min_y;
+            max_x = damage[i].x + damage[i].width > max_x ? damage[i].x + damage[i].width : max_x;
+            max_y = damage[i].y + damage[i].height > max_y ? damage[i].y + damage[i].height : max_y;
+        }
+
+        bitmap->damage[0] = (GuiRect){min_x, min_y, max_x - min_x, max_y - min_y};
+        bitmap->damage_count = 1;
+    } else {
+        memcpy(bitmap->damage, damage, (size_t)damage_count * sizeof(GuiRect));
+        bitmap->damage_count = damage_count;
+    }
+
+    window->present_count += 1;
+    bitmap->present_index = window->present_count;
+
+    // Nothing has changed, the bitmap stays available.
+    if (bitmap->damage_count == 0) {
+        return;
+    }
+
     bitmap->available = false;
 
-    XShmPutImage(
-        bitmap->window->display,
-        bitmap->window->handle,
-        DefaultGC(bitmap->window->display, bitmap->window->visual_info.screen),
-        bitmap->image,
-        0,
-        0,
-        0,
+    if (window->presenter.running) {
+        window->presenter.in_flight_count += 1;
+        bitmap_queue_push(&window->presenter.submitted, bitmap);
+        return;
+    }
+
+    if (!gui_bitmap_put(window->display, window, bitmap)) {
+        bitmap->available = true;
+    }
+}
+
+void gui_bitmap_render(GuiBitmap *bitmap, GuiRect const *damage, int damage_count) {
+    assert(bitmap->window->present_mode != GUI_PRESENT_RENDER);
+
+    gui_bitmap_submit(bitmap, damage, damage_count);
+}
+
+// Presenting through the Present extension goes back to copying pixmaps, which is fine as long as
+// the server doesn't hold any of them yet.
+bool gui_window_enable_server_scaling(GuiWindow *window, int scale) {
+    assert(window->present_count == 0);
+    assert(scale >= 1);
+
+#ifdef GUI_RENDER
+    GuiPresentMode mode = window->present_mode;
+    if (mode != GUI_PRESENT_SHM_PIXMAP && mode != GUI_PRESENT_EXTENSION) {
+        return false;
+    }
+
+    Display *display = gui_window_bitmap_display(window);
+
+    // Transforms and filters came with RENDER 0.6.
+    int event_base, error_base;
+    if (!XRenderQueryExtension(display, &event_base, &error_base)) {
+        return false;
+    }
+    int major_version, minor_version;
+    if (!XRenderQueryVersion(display, &major_version, &minor_version)) {
+        return false;
+    }
+    if (major_version == 0 && minor_version < 6) {
+        return false;
+    }
+
+    XRenderPictFormat *format = XRenderFindVisualFormat(display, window->visual_info.visual);
+    if (format == NULL) {
+        return false;
+    }
+
+#ifdef GUI_PRESENT
+    if (mode == GUI_PRESENT_EXTENSION) {
+        gui_present_destroy(display, window);
+    }
+#endif
+
+    window->present_mode = GUI_PRESENT_RENDER;
+    window->render.scale = scale;
+    window->render.format = format;
+    window->render.window_picture = XRenderCreatePicture(display, window->handle, format, 0, NULL);
+
+    for (isize i = 0; i < window->bitmap_count; i += 1) {
+        GuiBitmap *bitmap = &window->bitmaps[i];
+        if (bitmap->pixmap != None) {
+            gui_bitmap_create_picture(display, bitmap);
+        }
+    }
+    XSync(display, False);
+
+    return true;
+#else
+    (void)window;
+    return false;
+#endif
+}
+
+void gui_window_set_backdrop(GuiWindow *window, uint32_t const *pixels, int width, int height) {
+    assert(window->present_mode == GUI_PRESENT_RENDER);
+
+#ifdef GUI_RENDER
+    // The presenter reads the backdrop, and the connection is only ours while it holds nothing.
+    if (window->presenter.running) {
+        gui_presenter_drain(window);
+    }
+    Display *display = gui_window_bitmap_display(window);
+
+    if (
+        window->render.backdrop != None &&
+        (window->render.backdrop_width != width || window->render.backdrop_height != height)
+    ) {
+        XFreePixmap(display, window->render.backdrop);
+        window->render.backdrop = None;
+    }
+    window->render.backdrop_width = width;
+    window->render.backdrop_height = height;
+
+    // Pixmaps can't be empty.
+    if (width == 0 || height == 0) {
+        return;
+    }
+
+    if (window->render.backdrop == None) {
+        window->render.backdrop = XCreatePixmap(
+            display,
+            window->handle,
+            (unsigned int)width,
+            (unsigned int)height,
+            (unsigned int)window->visual_info.depth
+        );
+    }
+
+    // The image only borrows the pixels.
+    XImage *image = XCreateImage(
+        display,
+        window->visual_info.visual,
+        (unsigned int)window->visual_info.depth,
+        ZPixmap,
         0,
-        (unsigned int)bitmap->width,
-        (unsigned int)bitmap->height,
-        true
+        (char *)pixels,
+        (unsigned int)width,
+        (unsigned int)height,
+        32,
+        0
+    );
+    if (image == NULL) {
+        return;
+    }
+
+    XPutImage(
+        display,
+        window->render.backdrop,
+        window->present_gc,
+        image,
+        0, 0,
+        0, 0,
+        (unsigned int)width,
+        (unsigned int)height
     );
-    XFlush(bitmap->window->display);
+
+    image->data = NULL;
+    XDestroyImage(image);
+
+    // The window gets the new backdrop along with the next present.
+    window->exposed = true;
+#else
+    (void)pixels;
+    (void)width;
+    (void)height;
+#endif
+}
+
+void gui_bitmap_render_scaled(
+    GuiBitmap *bitmap,
+    GuiRect const *damage, int damage_count,
+    int x, int y, GuiRect clip
+) {
+    assert(bitmap->window->present_mode == GUI_PRESENT_RENDER);
+
+    bitmap->x = x;
+    bitmap->y = y;
+    bitmap->clip = clip;
+    bitmap->clip.width = clip.width < 0 ? 0 : clip.width;
+    bitmap->clip.height = clip.height < 0 ? 0 : clip.height;
+
+    gui_bitmap_submit(bitmap, damage, damage_count);
+}
+
+GuiPresentMode gui_window_present_mode(GuiWindow const *window) {
+    return window->present_mode;
+}
+
+double gui_window_display_time(GuiWindow const *window) {
+    isize display_time = isize_atomic_load((isize volatile *)&window->present.display_time);
+    if (display_time < 0) {
+        return -1.0;
+    }
+
+    return (f64)display_time / 1e6;
 }
 
 double gui_window_time(GuiWindow const *window) {
-    struct timespec current_time;
-    clock_gettime(CLOCK_MONOTONIC, &current_time);
+    return gui_window_time_since(&window->timer.created_time);
+}
 
-    return
-        (f64)(current_time.tv_sec - window->timer.created_time.tv_sec) +
-        (f64)(current_time.tv_nsec - window->timer.created_time.tv_nsec) / 1e9;
+double gui_window_input_time(GuiWindow const *window) {
+    return window->timer.last_input_time;
 }
 
 double gui_window_frame_time(GuiWindow const *window) {
@@ -600,8 +2338,51 @@ void gui_window_set_target_fps(GuiWindow *window, double target_fps) {
     window->target_fps = target_fps;
 }
 
+#ifdef GUI_RENDER
+
+static void gui_render_destroy(Display *display, GuiWindow *window) {
+    if (window->render.backdrop != None) {
+        XFreePixmap(display, window->render.backdrop);
+    }
+    XRenderFreePicture(display, window->render.window_picture);
+}
+
+#endif
+
 void gui_window_destroy(GuiWindow *window) {
-    gui_bitmap_destroy(window->display, &window->bitmap);
+    if (window->input.running) {
+        gui_input_stop(window);
+    }
+
+    if (window->presenter.running) {
+        gui_presenter_stop(window);
+#ifdef GUI_PRESENT
+        if (window->present_mode == GUI_PRESENT_EXTENSION) {
+            gui_present_destroy(window->presenter.display, window);
+        }
+#endif
+#ifdef GUI_RENDER
+        if (window->present_mode == GUI_PRESENT_RENDER) {
+            gui_render_destroy(window->presenter.display, window);
+        }
+#endif
+        for (isize i = 0; i < window->bitmap_count; i += 1) {
+            gui_bitmap_destroy(window->presenter.display, &window->bitmaps[i]);
+        }
+        XFreeGC(window->presenter.display, window->present_gc);
+        XCloseDisplay(window->presenter.display);
+    } else {
+#ifdef GUI_RENDER
+        if (window->present_mode == GUI_PRESENT_RENDER) {
+            gui_render_destroy(window->display, window);
+        }
+#endif
+        for (isize i = 0; i < window->bitmap_count; i += 1) {
+            gui_bitmap_destroy(window->display, &window->bitmaps[i]);
+        }
+        XFreeGC(window->display, window->present_gc);
+    }
+
     XDestroyWindow(window->display, window->handle);
     XCloseDisplay(window->display);
 }
@@ -669,11 +2450,16 @@ struct GuiWindow {
     HWND handle;
     HDC device_context;
     GuiBitmap bitmap;
+    // The only bitmap never has to be waited for.
+    int bitmap_request_count;
     volatile i32 should_close;
 
     volatile i32 width;
     volatile i32 height;
     volatile i32 resized;
+    volatile i32 minimized;
+    // Part of the window has lost its contents, so the next frame has to be presented in full.
+    volatile i32 exposed;
 
     volatile i32 mouse_x;
     volatile i32 mouse_y;
@@ -689,12 +2475,26 @@ struct GuiWindow {
         LARGE_INTEGER created_time;
         LARGE_INTEGER last_update_time;
         f64 last_frame_time;
+
+        // Message times are in milliseconds since the system start, so are input times.
+        DWORD created_tick;
+        volatile i32 last_input_tick;
     } timer;
 
     f64 target_fps;
     FPSCounter fps_counter;
 };
 
+// Nothing gets drawn right here, the next gui_bitmap_render blits the whole bitmap instead.
+// Validating the update region keeps the system from sending WM_PAINT over and over again.
+static void window_paint(HWND window_handle) {
+    GuiWindow *window = (GuiWindow *)GetWindowLongPtrW(window_handle, GWLP_USERDATA);
+    if (window != NULL) {
+        i32_atomic_store(&window->exposed, true);
+    }
+    ValidateRect(window_handle, NULL);
+}
+
 static LRESULT CALLBACK window_procedure(
     HWND window_handle,
     UINT message_type,
@@ -707,6 +2507,7 @@ static LRESULT CALLBACK window_procedure(
         switch (message_type) {
         // > An application returns zero if it processes this message.
         case WM_PAINT: {
+            window_paint(window_handle);
             return 0;
         } break;
 
@@ -721,6 +2522,8 @@ static LRESULT CALLBACK window_procedure(
         } break;
 
         case WM_SIZE: {
+            i32_atomic_store(&window->minimized, w_param == SIZE_MINIMIZED);
+
             i32 new_width = LOWORD(l_param);
             i32 new_height = HIWORD(l_param);
             if (window->width != new_width || window->height != new_height) {
@@ -731,6 +2534,7 @@ static LRESULT CALLBACK window_procedure(
         } break;
 
         case WM_MOUSEMOVE: {
+            i32_atomic_store(&window->timer.last_input_tick, (i32)GetMessageTime());
             i32 mouse_x = LOWORD(l_param);
             i32 mouse_y = HIWORD(l_param);
 
@@ -739,18 +2543,22 @@ static LRESULT CALLBACK window_procedure(
         } break;
 
         case WM_LBUTTONDOWN: {
+            i32_atomic_store(&window->timer.last_input_tick, (i32)GetMessageTime());
             i32_atomic_store(&window->mouse_buttons[GUI_MOUSE_BUTTON_LEFT].currently_down, 1);
         } break;
 
         case WM_LBUTTONUP: {
+            i32_atomic_store(&window->timer.last_input_tick, (i32)GetMessageTime());
             i32_atomic_store(&window->mouse_buttons[GUI_MOUSE_BUTTON_LEFT].currently_down, 0);
         } break;
 
         case WM_RBUTTONDOWN: {
+            i32_atomic_store(&window->timer.last_input_tick, (i32)GetMessageTime());
             i32_atomic_store(&window->mouse_buttons[GUI_MOUSE_BUTTON_RIGHT].currently_down, 1);
         } break;
 
         case WM_RBUTTONUP: {
+            i32_atomic_store(&window->timer.last_input_tick, (i32)GetMessageTime());
             i32_atomic_store(&window->mouse_buttons[GUI_MOUSE_BUTTON_RIGHT].currently_down, 0);
         } break;
         }
@@ -823,6 +2631,8 @@ static DWORD event_loop_procedure(LPVOID param) {
             // procedure.)
             if (message.message != WM_PAINT) {
                 DispatchMessage(&message);
+            } else {
+                window_paint(message.hwnd);
             }
         } break;
         }
@@ -965,6 +2775,7 @@ GuiWindow *gui_window_create(int width, int height, char const *title, void *are
     window->timer.created_time = created_time;
     window->timer.last_update_time = created_time;
     window->timer.last_frame_time = 0.0;
+    window->timer.created_tick = GetTickCount();
 
     fps_counter_init(&window->fps_counter);
     window->target_fps = 0.0;
@@ -990,6 +2801,10 @@ bool gui_window_resized(GuiWindow const *window) {
     return i32_atomic_exchange((volatile i32 *)&window->resized, false);
 }
 
+bool gui_window_visible(GuiWindow const *window) {
+    return i32_atomic_load((volatile i32 *)&window->minimized) == 0;
+}
+
 void gui_window_size(GuiWindow const *window, int *width, int *height) {
     *width = i32_atomic_load((volatile i32 *)&window->width);
     *height = i32_atomic_load((volatile i32 *)&window->height);
@@ -1068,6 +2883,13 @@ double gui_window_time(GuiWindow const *window) {
     return (f64)elapsed_us / 1e6;
 }
 
+double gui_window_input_time(GuiWindow const *window) {
+    // Input which came before the timer started counts as if it came right at the start.
+    DWORD last_input_tick = (DWORD)i32_atomic_load((volatile i32 *)&window->timer.last_input_tick);
+    i32 elapsed_millis = (i32)(last_input_tick - window->timer.created_tick);
+    return elapsed_millis > 0 ? (f64)elapsed_millis / 1e3 : 0.0;
+}
+
 double gui_window_frame_time(GuiWindow const *window) {
     return window->timer.last_frame_time;
 }
@@ -1084,9 +2906,25 @@ void gui_window_set_target_fps(GuiWindow *window, double target_fps) {
 }
 
 GuiBitmap *gui_window_bitmap(GuiWindow *window) {
+    window->bitmap_request_count += 1;
     return &window->bitmap;
 }
 
+void gui_window_bitmap_stats(GuiWindow const *window, int *request_count, int *stall_count) {
+    *request_count = window->bitmap_request_count;
+    *stall_count = 0;
+}
+
+GuiPresentMode gui_window_present_mode(GuiWindow const *window) {
+    (void)window;
+    return GUI_PRESENT_GDI_BLIT;
+}
+
+double gui_window_display_time(GuiWindow const *window) {
+    (void)window;
+    return -1.0;
+}
+
 uint32_t *gui_bitmap_data(GuiBitmap const *bitmap) {
     return bitmap->data;
 }
@@ -1135,18 +2973,55 @@ void gui_bitmap_size(GuiBitmap const *bitmap, int *width, int *height) {
     *height = bitmap->height;
 }
 
-void gui_bitmap_render(GuiBitmap *bitmap) {
-    BitBlt(
-        bitmap->window->device_context,
-        0,
-        0,
-        (int)bitmap->width,
-        (int)bitmap->height,
-        bitmap->device_context,
-        0,
-        0,
-        SRCCOPY
-    );
+void gui_bitmap_render(GuiBitmap *bitmap, GuiRect const *damage, int damage_count) {
+    GuiRect whole_bitmap = {0, 0, (int)bitmap->width, (int)bitmap->height};
+    if (i32_atomic_exchange(&bitmap->window->exposed, false) || damage == NULL) {
+        damage = &whole_bitmap;
+        damage_count = 1;
+    }
+
+    for (int i = 0; i < damage_count; i += 1) {
+        BitBlt(
+            bitmap->window->device_context,
+            damage[i].x,
+            damage[i].y,
+            damage[i].width,
+            damage[i].height,
+            bitmap->device_context,
+            damage[i].x,
+            damage[i].y,
+            SRCCOPY
+        );
+    }
+}
+
+// Scaling is left to the caller.
+bool gui_window_enable_server_scaling(GuiWindow *window, int scale) {
+    (void)window;
+    (void)scale;
+    return false;
+}
+
+void gui_window_set_backdrop(GuiWindow *window, uint32_t const *pixels, int width, int height) {
+    (void)window;
+    (void)pixels;
+    (void)width;
+    (void)height;
+    assert(false);
+}
+
+void gui_bitmap_render_scaled(
+    GuiBitmap *bitmap,
+    GuiRect const *damage, int damage_count,
+    int x, int y, GuiRect clip
+) {
+    (void)bitmap;
+    (void)damage;
+    (void)damage_count;
+    (void)x;
+    (void)y;
+    (void)clip;
+    assert(false);
 }
 
 #endif // _WIN32
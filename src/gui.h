@@ -15,6 +15,9 @@ void gui_window_destroy(GuiWindow *window);
 bool gui_window_should_close(GuiWindow *window);
 
 bool gui_window_resized(GuiWindow const *window);
+// False while the window is unmapped, minimized or fully covered by other windows, so that there is
+// no point in rendering into it. (Win32 only knows about being minimized.)
+bool gui_window_visible(GuiWindow const *window);
 void gui_window_size(GuiWindow const *window, int *width, int *height);
 
 void gui_mouse_position(GuiWindow const *window, int *mouse_x, int *mouse_y);
@@ -26,15 +29,77 @@ bool gui_mouse_button_was_pressed(GuiWindow const *window, int mouse_button);
 bool gui_mouse_button_was_released(GuiWindow const *window, int mouse_button);
 
 double gui_window_time(GuiWindow const *window);
+// Time of the latest input event handled so far (same clock as gui_window_time).
+double gui_window_input_time(GuiWindow const *window);
 double gui_window_frame_time(GuiWindow const *window);
 double gui_window_fps(GuiWindow const *window);
 
 typedef struct GuiBitmap GuiBitmap;
 
+// In pixels, relative to the top-left corner of a bitmap.
+typedef struct {
+    int x, y;
+    int width, height;
+} GuiRect;
+
+// The window cycles through up to this many bitmaps, so that the next frame could be rendered while
+// the previous one is still being presented. Each bitmap keeps whatever has been rendered into it.
+#define GUI_MAX_BITMAP_COUNT 3
+
+// Waits until one of the bitmaps is done being presented.
 GuiBitmap *gui_window_bitmap(GuiWindow *window);
+// How many times gui_window_bitmap has been called, and how many of those times it had to wait,
+// because all of the bitmaps were busy.
+void gui_window_bitmap_stats(GuiWindow const *window, int *request_count, int *stall_count);
 uint32_t *gui_bitmap_data(GuiBitmap const *bitmap);
 bool gui_bitmap_resize(GuiBitmap *bitmap, int width, int height);
 void gui_bitmap_size(GuiBitmap const *bitmap, int *width, int *height);
-void gui_bitmap_render(GuiBitmap *bitmap);
+
+// How bitmaps get into the window. Gets picked when the window is created, depending on what the
+// display server supports.
+typedef enum {
+    // X11: XShmPutImage out of a shared memory XImage.
+    GUI_PRESENT_SHM_IMAGE,
+    // X11: XCopyArea out of a shared memory pixmap, which the server keeps on its side.
+    GUI_PRESENT_SHM_PIXMAP,
+    // X11: PresentPixmap of a shared memory pixmap (the Present extension). Frames show up on the
+    // next vertical blank, and the server may flip them onto the screen instead of copying.
+    GUI_PRESENT_EXTENSION,
+    // X11: XPutImage out of process memory, when shared memory isn't available. Pixels get sent
+    // over the connection in bands of rows.
+    GUI_PRESENT_PUT_IMAGE,
+    // X11: XRenderComposite of a shared memory pixmap, scaled up by the server on the way into the
+    // window (the RENDER extension). Only after gui_window_enable_server_scaling.
+    GUI_PRESENT_RENDER,
+    // Win32: BitBlt out of a DIB section.
+    GUI_PRESENT_GDI_BLIT,
+} GuiPresentMode;
+
+GuiPresentMode gui_window_present_mode(GuiWindow const *window);
+// When the latest frame has actually shown up on the screen (same clock as gui_window_time), or a
+// negative value if the present mode doesn't tell.
+double gui_window_display_time(GuiWindow const *window);
+
+// Only presents the damaged parts of the bitmap, the rest of the window is expected to stay the
+// same as it was when the bitmap got presented the last time. Pass NULL to present the whole
+// bitmap.
+void gui_bitmap_render(GuiBitmap *bitmap, GuiRect const *damage, int damage_count);
+
+// Lets the server scale bitmaps up by an integer factor while presenting them, so that they only
+// have to be a fraction of the window size. Has to be called before anything gets presented.
+// Returns false if the server can't do that, in which case nothing changes.
+bool gui_window_enable_server_scaling(GuiWindow *window, int scale);
+// The server keeps a copy of the pixels and fills the window with it around the scaled bitmaps.
+// Waits for everything in flight to be presented first, so it's meant for things which rarely
+// change.
+void gui_window_set_backdrop(GuiWindow *window, uint32_t const *pixels, int width, int height);
+// Takes the place of gui_bitmap_render once server scaling is on. The top-left corner of the bitmap
+// ends up at (x, y) in the window, and nothing gets drawn outside the clip rectangle. Damage is in
+// bitmap pixels.
+void gui_bitmap_render_scaled(
+    GuiBitmap *bitmap,
+    GuiRect const *damage, int damage_count,
+    int x, int y, GuiRect clip
+);
 
 #endif
@@ -0,0 +1,680 @@
+#include "jobs.h"
+
+#include <assert.h> // assert
+#include <stdlib.h> // abort, calloc, free
+#include <string.h> // memset
+
+// Redefinition of typedefs is a C11 feature.
+// This is the official™ guard, which is used across different headers to protect u8 and friends.
+// (Or just add a #define before including this header, if you already have short names defined.)
+#ifndef SHORT_NAMES_FOR_PRIMITIVE_TYPES_WERE_DEFINED
+    #define SHORT_NAMES_FOR_PRIMITIVE_TYPES_WERE_DEFINED
+    #include <stdint.h>
+    #include <stddef.h>
+
+    typedef uint8_t   u8; typedef int8_t   i8;
+    typedef uint16_t u16; typedef int16_t i16;
+    typedef uint32_t u32; typedef int32_t i32;
+    typedef uint64_t u64; typedef int64_t i64;
+
+    typedef size_t   usize; typedef ptrdiff_t isize;
+    typedef uintptr_t uptr;
+
+    typedef float f32; typedef double f64;
+#endif
+
+typedef struct {
+    u8 *begin;
+    u8 *end;
+} Arena;
+
+#define ARENA_ALIGNMENT 16
+
+static void *arena_alloc(Arena *arena, isize size) {
+    assert(size > 0);
+
+    isize padding = (~(uptr)arena->begin + 1) & (ARENA_ALIGNMENT - 1);
+    isize memory_left = arena->end - arena->begin - padding;
+    if (memory_left < 0 || memory_left < size) {
+        abort();
+    }
+
+    void *ptr = arena->begin + padding;
+    arena->begin += padding + size;
+    return ptr;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+
+#define THREAD_LOCAL _Thread_local
+
+static isize isize_atomic_load(isize volatile *source) {
+    return __atomic_load_n(source, __ATOMIC_SEQ_CST);
+}
+
+static void isize_atomic_store(isize volatile *dest, isize value) {
+    __atomic_store_n(dest, value, __ATOMIC_SEQ_CST);
+}
+
+// Returns the value before the addition.
+static isize isize_atomic_fetch_add(isize volatile *target, isize value) {
+    return __atomic_fetch_add(target, value, __ATOMIC_SEQ_CST);
+}
+
+static bool isize_atomic_compare_exchange(isize volatile *target, isize expected, isize desired) {
+    return __atomic_compare_exchange_n(
+        target, &expected, desired,
+        false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST
+    );
+}
+
+static void *ptr_atomic_load(void *volatile *source) {
+    return __atomic_load_n(source, __ATOMIC_ACQUIRE);
+}
+
+static void ptr_atomic_store(void *volatile *dest, void *value) {
+    __atomic_store_n(dest, value, __ATOMIC_RELEASE);
+}
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+#elif defined(_MSC_VER)
+
+#include <intrin.h>
+
+#define THREAD_LOCAL __declspec(thread)
+
+static isize isize_atomic_load(isize volatile *source) {
+    return _InterlockedCompareExchange64((__int64 volatile *)source, 0, 0);
+}
+
+static void isize_atomic_store(isize volatile *dest, isize value) {
+    _InterlockedExchange64((__int64 volatile *)dest, value);
+}
+
+static isize isize_atomic_fetch_add(isize volatile *target, isize value) {
+    return _InterlockedExchangeAdd64((__int64 volatile *)target, value);
+}
+
+static bool isize_atomic_compare_exchange(isize volatile *target, isize expected, isize desired) {
+    return _InterlockedCompareExchange64((__int64 volatile *)target, desired, expected) == expected;
+}
+
+static void *ptr_atomic_load(void *volatile *source) {
+    return _InterlockedCompareExchangePointer(source, NULL, NULL);
+}
+
+static void ptr_atomic_store(void *volatile *dest, void *value) {
+    _InterlockedExchangePointer(dest, value);
+}
+
+static void cpu_relax(void) {
+    _mm_pause();
+}
+
+#endif
+
+#ifdef __linux__
+
+#include <pthread.h>
+#include <unistd.h> // sysconf
+
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Condition;
+
+typedef void ThreadFunction(void *data);
+
+typedef struct {
+    ThreadFunction *function;
+    void *data;
+} ThreadStart;
+
+static void *thread_procedure(void *param) {
+    ThreadStart *start = param;
+    start->function(start->data);
+    return NULL;
+}
+
+// The start structure has to outlive the thread.
+static bool thread_create(Thread *thread, ThreadStart *start) {
+    return pthread_create(thread, NULL, thread_procedure, start) == 0;
+}
+
+static void thread_join(Thread thread) {
+    pthread_join(thread, NULL);
+}
+
+static int cpu_core_count(void) {
+    long core_count = sysconf(_SC_NPROCESSORS_ONLN);
+    return core_count > 0 ? (int)core_count : 1;
+}
+
+static void mutex_init(Mutex *mutex) {
+    pthread_mutex_init(mutex, NULL);
+}
+
+static void mutex_destroy(Mutex *mutex) {
+    pthread_mutex_destroy(mutex);
+}
+
+static void mutex_lock(Mutex *mutex) {
+    pthread_mutex_lock(mutex);
+}
+
+static void mutex_unlock(Mutex *mutex) {
+    pthread_mutex_unlock(mutex);
+}
+
+static void condition_init(Condition *condition) {
+    pthread_cond_init(condition, NULL);
+}
+
+static void condition_destroy(Condition *condition) {
+    pthread_cond_destroy(condition);
+}
+
+static void condition_wait(Condition *condition, Mutex *mutex) {
+    pthread_cond_wait(condition, mutex);
+}
+
+static void condition_broadcast(Condition *condition) {
+    pthread_cond_broadcast(condition);
+}
+
+#endif // __linux__
+
+#ifdef _WIN32
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Condition;
+
+typedef void ThreadFunction(void *data);
+
+typedef struct {
+    ThreadFunction *function;
+    void *data;
+} ThreadStart;
+
+static DWORD WINAPI thread_procedure(LPVOID param) {
+    ThreadStart *start = param;
+    start->function(start->data);
+    return 0;
+}
+
+// The start structure has to outlive the thread.
+static bool thread_create(Thread *thread, ThreadStart *start) {
+    *thread = CreateThread(NULL, 0, thread_procedure, start, 0, NULL);
+    return *thread != NULL;
+}
+
+static void thread_join(Thread thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+static int cpu_core_count(void) {
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    return system_info.dwNumberOfProcessors > 0 ? (int)system_info.dwNumberOfProcessors : 1;
+}
+
+static void mutex_init(Mutex *mutex) {
+    InitializeCriticalSection(mutex);
+}
+
+static void mutex_destroy(Mutex *mutex) {
+    DeleteCriticalSection(mutex);
+}
+
+static void mutex_lock(Mutex *mutex) {
+    EnterCriticalSection(mutex);
+}
+
+static void mutex_unlock(Mutex *mutex) {
+    LeaveCriticalSection(mutex);
+}
+
+static void condition_init(Condition *condition) {
+    InitializeConditionVariable(condition);
+}
+
+static void condition_destroy(Condition *condition) {
+    (void)condition;
+}
+
+static void condition_wait(Condition *condition, Mutex *mutex) {
+    SleepConditionVariableCS(condition, mutex, INFINITE);
+}
+
+static void condition_broadcast(Condition *condition) {
+    WakeAllConditionVariable(condition);
+}
+
+#endif // _WIN32
+
+
+// Chase-Lev work-stealing deque of a single thread. The owner pushes and pops jobs at the bottom,
+// while other threads steal from the top. Capacity is fixed: when the deque is full, the owner
+// runs the job right away instead of queueing it.
+
+#define JOB_DEQUE_CAPACITY 1024
+
+typedef struct {
+    isize volatile top;
+    isize volatile bottom;
+    Job *volatile jobs[JOB_DEQUE_CAPACITY];
+} JobDeque;
+
+static bool job_deque_push(JobDeque *deque, Job *job) {
+    isize bottom = isize_atomic_load(&deque->bottom);
+    isize top = isize_atomic_load(&deque->top);
+    if (bottom - top >= JOB_DEQUE_CAPACITY) {
+        return false;
+    }
+
+    ptr_atomic_store((void *volatile *)&deque->jobs[bottom % JOB_DEQUE_CAPACITY], job);
+    isize_atomic_store(&deque->bottom, bottom + 1);
+    return true;
+}
+
+static Job *job_deque_pop(JobDeque *deque) {
+    isize bottom = isize_atomic_load(&deque->bottom) - 1;
+    isize_atomic_store(&deque->bottom, bottom);
+    isize top = isize_atomic_load(&deque->top);
+
+    if (top > bottom) {
+        isize_atomic_store(&deque->bottom, bottom + 1);
+        return NULL;
+    }
+
+    Job *job = ptr_atomic_load((void *volatile *)&deque->jobs[bottom % JOB_DEQUE_CAPACITY]);
+    if (top == bottom) {
+        // The last job: race against the thieves for it.
+        if (!isize_atomic_compare_exchange(&deque->top, top, top + 1)) {
+            job = NULL;
+        }
+        isize_atomic_store(&deque->bottom, bottom + 1);
+    }
+
+    return job;
+}
+
+// Returns NULL if the deque is empty or if another thread has stolen the job first.
+static Job *job_deque_steal(JobDeque *deque) {
+    isize top = isize_atomic_load(&deque->top);
+    isize bottom = isize_atomic_load(&deque->bottom);
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    Job *job = ptr_atomic_load((void *volatile *)&deque->jobs[top % JOB_DEQUE_CAPACITY]);
+    if (!isize_atomic_compare_exchange(&deque->top, top, top + 1)) {
+        return NULL;
+    }
+
+    return job;
+}
+
+// Jobs queued by job_run_on_workers. Deques only take jobs from their owners, so these go into a
+// separate list instead, which is guarded by the mutex of the system.
+#define JOB_HANDOFF_CAPACITY 16
+
+typedef struct {
+    JobSystem *jobs;
+    int thread_index;
+    JobDeque deque;
+
+    Thread thread;
+    ThreadStart start;
+} Worker;
+
+struct JobSystem {
+    // The first worker is the thread which has created the system, it has no thread of its own.
+    Worker *workers;
+    int thread_count;
+    int started_count;
+
+    // Threads which run out of jobs park here instead of spinning. Every time something happens
+    // which a parked thread might be interested in (a job gets queued or a counter drops to zero),
+    // the epoch gets incremented, and parked threads get woken up.
+    Mutex mutex;
+    Condition wake_up;
+    isize volatile epoch;
+    isize volatile parked_count;
+
+    Job *handoff[JOB_HANDOFF_CAPACITY];
+    // Gets read without the mutex to skip locking it when the list is empty.
+    isize volatile handoff_count;
+
+    isize volatile should_quit;
+};
+
+// Set for every thread which runs jobs.
+static THREAD_LOCAL Worker *current_worker;
+
+// Spin on empty deques for a bit before parking, because parking costs a syscall on both ends.
+#define JOB_SPIN_COUNT 64
+
+static void job_system_wake_up(JobSystem *jobs) {
+    isize_atomic_fetch_add(&jobs->epoch, 1);
+    if (isize_atomic_load(&jobs->parked_count) > 0) {
+        mutex_lock(&jobs->mutex);
+        condition_broadcast(&jobs->wake_up);
+        mutex_unlock(&jobs->mutex);
+    }
+}
+
+// Returns right away if the epoch has changed since it was read (something has been queued in
+// between, but after the caller has last looked).
+static void job_system_park(JobSystem *jobs, isize epoch) {
+    mutex_lock(&jobs->mutex);
+    isize_atomic_fetch_add(&jobs->parked_count, 1);
+    while (
+        isize_atomic_load(&jobs->epoch) == epoch &&
+        !isize_atomic_load(&jobs->should_quit)
+    ) {
+        condition_wait(&jobs->wake_up, &jobs->mutex);
+    }
+    isize_atomic_fetch_add(&jobs->parked_count, -1);
+    mutex_unlock(&jobs->mutex);
+}
+
+// Returns NULL if the list is empty.
+static Job *job_handoff_take(JobSystem *jobs) {
+    if (isize_atomic_load(&jobs->handoff_count) == 0) {
+        return NULL;
+    }
+
+    Job *job = NULL;
+    mutex_lock(&jobs->mutex);
+    isize count = jobs->handoff_count;
+    if (count > 0) {
+        job = jobs->handoff[count - 1];
+        isize_atomic_store(&jobs->handoff_count, count - 1);
+    }
+    mutex_unlock(&jobs->mutex);
+
+    return job;
+}
+
+static Job *job_find(Worker *worker) {
+    Job *job = job_deque_pop(&worker->deque);
+    if (job != NULL) {
+        return job;
+    }
+
+    // The calling thread of the system never takes handed off jobs.
+    JobSystem *jobs = worker->jobs;
+    if (worker->thread_index != 0) {
+        job = job_handoff_take(jobs);
+        if (job != NULL) {
+            return job;
+        }
+    }
+
+    for (int i = 1; i < jobs->thread_count; i += 1) {
+        Worker *victim = &jobs->workers[(worker->thread_index + i) % jobs->thread_count];
+        job = job_deque_steal(&victim->deque);
+        if (job != NULL) {
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+static void job_execute(Worker *worker, Job *job) {
+    // Read the counter before the call: the job might be gone once the counter drops to zero.
+    JobCounter *counter = job->counter;
+    job->function(job->data, job->index, worker->thread_index);
+
+    if (isize_atomic_fetch_add(&counter->pending, -1) == 1) {
+        job_system_wake_up(worker->jobs);
+    }
+}
+
+static void worker_procedure(void *param) {
+    Worker *worker = param;
+    JobSystem *jobs = worker->jobs;
+    current_worker = worker;
+
+    isize idle_count = 0;
+    while (!isize_atomic_load(&jobs->should_quit)) {
+        isize epoch = isize_atomic_load(&jobs->epoch);
+
+        Job *job = job_find(worker);
+        if (job != NULL) {
+            job_execute(worker, job);
+            idle_count = 0;
+        } else if (idle_count < JOB_SPIN_COUNT) {
+            cpu_relax();
+            idle_count += 1;
+        } else {
+            job_system_park(jobs, epoch);
+            idle_count = 0;
+        }
+    }
+}
+
+JobSystem *job_system_create(int worker_count, void *arena) {
+    if (worker_count < 0) {
+        worker_count = cpu_core_count() - 1;
+    }
+
+    // Every worker carries its whole deque inline, so with the worker count coming from the
+    // machine they go on the heap rather than into the arena of the caller.
+    Worker *workers = calloc((size_t)worker_count + 1, sizeof(Worker));
+    if (workers == NULL) {
+        return NULL;
+    }
+
+    JobSystem *jobs = arena_alloc(arena, sizeof(JobSystem));
+    memset(jobs, 0, sizeof(JobSystem));
+
+    mutex_init(&jobs->mutex);
+    condition_init(&jobs->wake_up);
+
+    jobs->workers = workers;
+
+    jobs->thread_count = worker_count + 1;
+    for (int i = 0; i < jobs->thread_count; i += 1) {
+        jobs->workers[i].jobs = jobs;
+        jobs->workers[i].thread_index = i;
+    }
+    current_worker = &jobs->workers[0];
+
+    for (int i = 1; i < jobs->thread_count; i += 1) {
+        Worker *worker = &jobs->workers[i];
+        worker->start = (ThreadStart){worker_procedure, worker};
+
+        // Just go with less workers if we can't start all of them. Deques of the missing ones stay
+        // empty, and the rest of the threads take over their share of jobs.
+        if (!thread_create(&worker->thread, &worker->start)) {
+            break;
+        }
+        jobs->started_count += 1;
+    }
+
+    return jobs;
+}
+
+void job_system_destroy(JobSystem *jobs) {
+    isize_atomic_store(&jobs->should_quit, true);
+    job_system_wake_up(jobs);
+
+    for (int i = 1; i <= jobs->started_count; i += 1) {
+        thread_join(jobs->workers[i].thread);
+    }
+
+    condition_destroy(&jobs->wake_up);
+    mutex_destroy(&jobs->mutex);
+
+    if (current_worker == &jobs->workers[0]) {
+        current_worker = NULL;
+    }
+
+    free(jobs->workers);
+}
+
+int job_system_thread_count(JobSystem const *jobs) {
+    return jobs->thread_count;
+}
+
+void job_run(JobSystem *jobs, Job *job_array, ptrdiff_t job_count, JobCounter *counter) {
+    Worker *worker = current_worker;
+    assert(worker != NULL && worker->jobs == jobs);
+
+    if (job_count <= 0) {
+        return;
+    }
+
+    isize_atomic_fetch_add(&counter->pending, job_count);
+
+    for (isize i = 0; i < job_count; i += 1) {
+        Job *job = &job_array[i];
+        job->counter = counter;
+
+        if (!job_deque_push(&worker->deque, job)) {
+            job_execute(worker, job);
+        }
+    }
+
+    job_system_wake_up(jobs);
+}
+
+void job_run_on_workers(
+    JobSystem *jobs,
+    Job *job_array,
+    ptrdiff_t job_count,
+    JobCounter *counter
+) {
+    Worker *worker = current_worker;
+    assert(worker != NULL && worker->jobs == jobs);
+
+    if (job_count <= 0) {
+        return;
+    }
+
+    isize_atomic_fetch_add(&counter->pending, job_count);
+
+    for (isize i = 0; i < job_count; i += 1) {
+        Job *job = &job_array[i];
+        job->counter = counter;
+
+        // Without workers, or when the list is full, the job gets run right away, same as when a
+        // deque is full.
+        bool queued = false;
+        if (jobs->started_count > 0) {
+            mutex_lock(&jobs->mutex);
+            isize count = jobs->handoff_count;
+            if (count < JOB_HANDOFF_CAPACITY) {
+                jobs->handoff[count] = job;
+                isize_atomic_store(&jobs->handoff_count, count + 1);
+                queued = true;
+            }
+            mutex_unlock(&jobs->mutex);
+        }
+
+        if (!queued) {
+            job_execute(worker, job);
+        }
+    }
+
+    job_system_wake_up(jobs);
+}
+
+void job_wait(JobSystem *jobs, JobCounter *counter) {
+    Worker *worker = current_worker;
+    assert(worker != NULL && worker->jobs == jobs);
+
+    isize idle_count = 0;
+    while (true) {
+        isize epoch = isize_atomic_load(&jobs->epoch);
+        if (isize_atomic_load(&counter->pending) == 0) {
+            break;
+        }
+
+        Job *job = job_find(worker);
+        if (job != NULL) {
+            job_execute(worker, job);
+            idle_count = 0;
+        } else if (idle_count < JOB_SPIN_COUNT) {
+            cpu_relax();
+            idle_count += 1;
+        } else {
+            // The rest of the jobs are being run by other threads.
+            job_system_park(jobs, epoch);
+            idle_count = 0;
+        }
+    }
+}
+
+// Indices of a parallel for loop are split into contiguous chunks, a job per chunk. There are a few
+// chunks per thread, so that threads which finish early could steal from the others.
+
+#define PARALLEL_FOR_CHUNKS_PER_THREAD 4
+#define PARALLEL_FOR_MAX_CHUNKS 256
+
+typedef struct {
+    JobFunction *function;
+    void *data;
+    isize count;
+    isize chunk_count;
+} ParallelFor;
+
+static void parallel_for_chunk(void *data, isize chunk_index, int thread_index) {
+    ParallelFor const *loop = data;
+
+    isize from = loop->count * chunk_index / loop->chunk_count;
+    isize to = loop->count * (chunk_index + 1) / loop->chunk_count;
+    for (isize i = from; i < to; i += 1) {
+        loop->function(loop->data, i, thread_index);
+    }
+}
+
+void job_parallel_for(JobSystem *jobs, ptrdiff_t count, JobFunction *function, void *data) {
+    if (count <= 0) {
+        return;
+    }
+
+    // Not worth waking anybody up.
+    if (jobs->started_count == 0 || count == 1) {
+        int thread_index = current_worker != NULL ? current_worker->thread_index : 0;
+        for (isize i = 0; i < count; i += 1) {
+            function(data, i, thread_index);
+        }
+        return;
+    }
+
+    ParallelFor loop = {
+        .function = function,
+        .data = data,
+        .count = count,
+        .chunk_count = jobs->thread_count * PARALLEL_FOR_CHUNKS_PER_THREAD,
+    };
+    if (loop.chunk_count > PARALLEL_FOR_MAX_CHUNKS) {
+        loop.chunk_count = PARALLEL_FOR_MAX_CHUNKS;
+    }
+    if (loop.chunk_count > count) {
+        loop.chunk_count = count;
+    }
+
+    Job chunk_jobs[PARALLEL_FOR_MAX_CHUNKS];
+    for (isize i = 0; i < loop.chunk_count; i += 1) {
+        chunk_jobs[i] = (Job){parallel_for_chunk, &loop, i, NULL};
+    }
+
+    JobCounter counter = {0};
+    job_run(jobs, chunk_jobs, loop.chunk_count, &counter);
+    job_wait(jobs, &counter);
+}
@@ -0,0 +1,63 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct JobSystem JobSystem;
+
+// Arena is a pair of pointers: struct { unsigned char *begin; unsigned char *end; }
+//
+// Pass a negative worker count to start one worker per CPU core besides the calling thread. Only
+// the system itself comes out of the arena, the workers get allocated on the heap. Returns NULL if
+// that allocation fails.
+JobSystem *job_system_create(int worker_count, void *arena);
+void job_system_destroy(JobSystem *jobs);
+
+// Number of threads which run jobs: all of the workers plus the thread which created the system.
+// Thread indices passed into jobs are in the [0, thread count) range, 0 being the calling thread.
+int job_system_thread_count(JobSystem const *jobs);
+
+typedef void JobFunction(void *data, ptrdiff_t index, int thread_index);
+
+// Gets decremented by every job which finishes. Zero-initialize before passing into job_run.
+typedef struct {
+    ptrdiff_t volatile pending;
+} JobCounter;
+
+typedef struct {
+    JobFunction *function;
+    void *data;
+    // Gets passed into the function as is.
+    ptrdiff_t index;
+
+    // Filled in by job_run.
+    JobCounter *counter;
+} Job;
+
+// Queues jobs onto the deque of the calling thread, from where idle threads steal them. The jobs
+// array has to stay alive until the counter is waited for.
+//
+// Jobs can only be queued from the thread which has created the system or from inside of jobs.
+void job_run(JobSystem *jobs, Job *job_array, ptrdiff_t job_count, JobCounter *counter);
+
+// Same as job_run, except that the calling thread never picks these jobs up itself, not even while
+// waiting for some other counter, so they are sure to run alongside whatever it does next. Meant
+// for a few long jobs. Without workers they get run right away.
+void job_run_on_workers(
+    JobSystem *jobs,
+    Job *job_array,
+    ptrdiff_t job_count,
+    JobCounter *counter
+);
+
+// Runs queued jobs (not necessarily the ones the counter belongs to) until the counter drops to
+// zero, so waiting from inside of a job is fine.
+void job_wait(JobSystem *jobs, JobCounter *counter);
+
+// Calls the function for every index in the [0, count) range, spreading the calls across all
+// threads, the calling one included. Returns once all of the calls have finished.
+void job_parallel_for(JobSystem *jobs, ptrdiff_t count, JobFunction *function, void *data);
+
+#endif